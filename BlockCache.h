@@ -0,0 +1,110 @@
+#pragma once
+
+#include "IoScheduler.h"
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+
+#include <QByteArray>
+#include <QFile>
+#include <QIODevice>
+#include <QMutex>
+#include <QString>
+
+// Recently read blocks of an image, shared by all threads reading it.
+//
+// Blocks are read with positional reads, so the file has no position shared
+// between threads, and are ordered by a scheduler on rotational disks. They
+// are spread over shards by index, each with its own lock and least recently
+// used list, so threads reading different blocks rarely wait on each other.
+class BlockCache
+{
+public:
+	~BlockCache();
+
+	// Opens the file at the path, keeping up to budget bytes of it in memory.
+	// Reads are scheduled with the queue depth if the file is on a rotational
+	// disk, and limited by the controller otherwise. Returns false if it
+	// can't be opened.
+	bool open(const QString& path, uint64_t budget, int queueDepth,
+		ConcurrencyController* controller);
+
+	void close();
+
+	// Returns the size of the file.
+	uint64_t size() const;
+
+	// Reads up to size bytes at the offset into data. Returns the number of
+	// bytes read, or -1 if the file can't be read.
+	int64_t read(uint64_t offset, char* data, int64_t size);
+
+	// As above, but straight from the file without keeping the data, for
+	// passes over the image that would only push out blocks still in use.
+	int64_t readUncached(uint64_t offset, char* data, int64_t size);
+
+	// Reads the blocks in the range into the cache ahead of use, without
+	// counting them as hits or misses.
+	void load(uint64_t offset, uint64_t size);
+
+	// Returns whether reads from the file are scheduled.
+	bool isScheduled() const;
+
+	// Returns the file the blocks are read from.
+	const QFile& source() const;
+
+	// Returns the number of blocks read that were already cached.
+	uint64_t hits() const;
+
+	// Returns the number of blocks read that had to be read from the file.
+	uint64_t misses() const;
+
+	static constexpr int blockSize = 0x10000;
+	static constexpr int shardCount = 16;
+
+private:
+	struct Block
+	{
+		QByteArray data;
+		std::list<uint64_t>::iterator use; // Position in the shard's uses
+	};
+
+	struct Shard
+	{
+		QMutex mutex;
+		std::unordered_map<uint64_t, Block> blocks;
+		std::list<uint64_t> uses; // Block indices, most recently used first
+		uint64_t used = 0; // Bytes in blocks
+	};
+
+	// Returns the block at the index, reading it on a miss. Empty if it
+	// can't be read.
+	QByteArray block(uint64_t index, bool counted = true);
+
+	QFile file;
+	intptr_t handle = -1; // Native handle, used for positional reads
+	IoScheduler scheduler;
+	uint64_t fileSize = 0;
+	uint64_t shardBudget = 0;
+	Shard shards[shardCount];
+	std::atomic<uint64_t> hitCount = 0;
+	std::atomic<uint64_t> missCount = 0;
+};
+
+// A read-only view of the image in a block cache. Each view has its own
+// position, so every thread uses its own view of the same cache.
+class CachedImage : public QIODevice
+{
+public:
+	explicit CachedImage(BlockCache& cache);
+
+	qint64 size() const override;
+
+protected:
+	qint64 readData(char* data, qint64 maxSize) override;
+	qint64 writeData(const char* data, qint64 maxSize) override;
+
+private:
+	BlockCache& cache;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <utility>
+
+#include <QMutex>
+#include <QWaitCondition>
+
+// Items passed from the threads producing them to the threads working on
+// them, never holding more than a capacity.
+//
+// Producers don't wait for room, since the threads which would make it may
+// be producing too. A producer finding the queue full works on the item
+// itself instead, which holds it back until the consumers catch up.
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	// Adds the item if the queue is open and has room. Returns whether it was
+	// added.
+	bool tryPush(const T& item)
+	{
+		QMutexLocker locker(&mutex);
+		if (closed || items.size() >= capacity)
+			return false;
+		items.push_back(item);
+		itemQueued.wakeOne();
+		return true;
+	}
+
+	// Takes the oldest item if there is one. Returns whether one was taken.
+	bool tryPop(T& item)
+	{
+		QMutexLocker locker(&mutex);
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		return true;
+	}
+
+	// Copies the oldest item if there is one, leaving it queued. Returns
+	// whether there was one.
+	bool tryPeek(T& item)
+	{
+		QMutexLocker locker(&mutex);
+		if (items.empty())
+			return false;
+		item = items.front();
+		return true;
+	}
+
+	// Takes the oldest item, waiting for one while the queue is open. Returns
+	// false once it is closed and empty.
+	bool pop(T& item)
+	{
+		QMutexLocker locker(&mutex);
+		while (items.empty() && !closed)
+			itemQueued.wait(&mutex);
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		return true;
+	}
+
+	// Stops items being added, and wakes the threads waiting for one.
+	void close()
+	{
+		QMutexLocker locker(&mutex);
+		closed = true;
+		itemQueued.wakeAll();
+	}
+
+private:
+	QMutex mutex;
+	QWaitCondition itemQueued;
+	std::deque<T> items;
+	size_t capacity;
+	bool closed = false;
+};
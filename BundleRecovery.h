@@ -1,13 +1,28 @@
 #pragma once
 
+#include "BlockCache.h"
+#include "BoundedQueue.h"
+#include "CandidateOrder.h"
+#include "ClaimedSectors.h"
+#include "ConcurrencyController.h"
+#include "ContinuationMemo.h"
+#include "Executor.h"
+#include "Inflater.h"
+#include "Journal.h"
+#include "Prefetcher.h"
+#include "SectorMap.h"
 #include "ui_BundleRecovery.h"
 
+#include <atomic>
 #include <bit>
 #include <cstdint>
+#include <map>
+#include <unordered_map>
 #include <vector>
 
 #include <libdeflate.h>
 
+#include <QByteArray>
 #include <QDialog>
 #include <QDir>
 #include <QFile>
@@ -24,7 +39,7 @@ public:
 	~BundleRecovery();
 
 	QMutex mutex;
-	std::vector<QThread*> threads;
+	Executor executor; // Threads every stage runs its tasks on
 
 	QString input;
 	QString output;
@@ -35,6 +50,9 @@ public:
 	uint64_t endOffset = 9007199254740992; // Double precision step limit
 	uint64_t interval = 2048;
 	uint64_t searchLength = 0; // Do not search for fragments by default
+	int beamWidth = 1; // Fragment chains kept while defragmenting zlib data
+	int defragBudget = 60; // Seconds per bundle before it is deferred, 0 for none
+	int queueDepth = 32; // Reads per sweep of a rotational disk
 
 	// The type of corruption occuring in the bundle.
 	enum class CorruptionType : int8_t
@@ -58,6 +76,15 @@ public:
 		std::vector<uint32_t> sz;
 	};
 
+	// Bundle data assembled from its fragments in the image. Shared by every
+	// check made on a bundle so the same data is only read once.
+	struct BundleBuffer
+	{
+		QByteArray data;
+		// Fragment positions and sizes the data was read with
+		FileInfo read;
+	};
+
 	// Size and alignment
 	struct BundleSAA
 	{
@@ -123,6 +150,78 @@ public:
 		uint32_t offset;
 	};
 
+	// Recovery progress replayed from the journal
+	struct Checkpoint
+	{
+		// Image ranges completely scanned by the Finder
+		std::vector<std::pair<uint64_t, uint64_t>> scanned;
+		// Bundles found by the Finder, keyed by offset
+		std::map<uint64_t, Bundle> found;
+	};
+
+	Checkpoint checkpoint; // Progress on the input image
+	QMutex checkpointMutex;
+	Journal journal; // Results for the input image as they are produced
+	SectorMap sectorMap; // Contents of every sector, built by the Finder
+	BlockCache imageCache; // Image data read by every stage after the Finder
+	Prefetcher prefetcher; // Reads image data into the cache ahead of use
+	ConcurrencyController ioThreads; // Threads reading the image at once
+	ConcurrencyController cpuThreads; // Threads working on bundles at once
+	int64_t stageStart = 0; // Time the current stage started
+	ClaimedSectors claimedSectors; // Sectors known to belong to a bundle
+	GapModel gapModel; // Gaps between fragments found this run
+	ContinuationMemo continuationMemo; // Results of zlib fragment candidates
+	std::atomic<uint64_t> memoStates = 0; // Ids of inflate states for the memo
+
+	// Whole-image search for the continuation of a corrupt compressed
+	// resource. Searches are deferred so all of them share one pass over the
+	// image.
+	struct ZlibQuery
+	{
+		int bundle; // Index of the bundle
+		FileInfo info; // Fragments known before the search
+		QByteArray resource; // Compressed resource, including corrupt data
+		int resourceOffset; // Offset of the resource in the bundle
+		int uncompressedSize;
+		int intendedSize; // Size of the bundle
+		std::vector<int> truncations; // Bundle offsets to truncate data at
+		std::vector<int> anchors; // Bundle offsets of following zlib headers
+		int truncation = -1; // Truncation point of the match
+		uint64_t match = UINT64_MAX; // Image offset of the match
+	};
+
+	// A chain of fragments tried while defragmenting zlib data. Several are
+	// kept at once, so a wrong choice early on doesn't rule out the rest.
+	struct ZlibHypothesis
+	{
+		FileInfo info;
+		BundleBuffer buffer;
+		CorruptionType corrupt;
+		int validSize = 0; // Bytes of the bundle which decompress
+		std::vector<bool> validResources; // See checkCompressedResources
+		int anchorHits = 0; // Zlib headers at exactly the offsets expected
+		std::vector<int64_t> gaps; // Gaps to each fragment added to the chain
+		ZlibQuery query; // Whole-image search if no fragment was found nearby
+		int truncation = -1; // Truncation point to resume extending it from
+	};
+
+	// Progress of the search for a bundle's zlib fragments, kept if the bundle
+	// runs out of time so the search resumes where it stopped.
+	struct ZlibSearch
+	{
+		std::vector<ZlibHypothesis> beam; // Chains being extended
+		int expanded = 0; // Chains of the beam done extending
+		std::vector<ZlibHypothesis> children; // Found for the chain being done
+		std::vector<ZlibHypothesis> next; // Found for the chains done
+		ZlibHypothesis best; // Furthest chain no fragment was found for
+		bool failed = false; // Whether best is set
+	};
+
+	std::vector<ZlibQuery> zlibQueries; // Searches waiting for the next pass
+	QMutex zlibQueriesMutex;
+	std::map<int, ZlibSearch> zlibSearches; // Searches out of time, by bundle
+	QMutex zlibSearchesMutex;
+
 private:
 	Ui::Dialog ui;
 
@@ -130,7 +229,13 @@ private:
 	//                         BundleRecovery.cpp
 	// *************************************************************************
 
-	void clearThreads();
+	// Starts a stage with as many threads reading the image at once as suit
+	// its disk, and every thread working on bundles.
+	void resetConcurrency(int numThreads);
+
+	// Logs the time the stage took and the number of threads it settled on for
+	// each kind of work.
+	void logConcurrency(const QString& stage);
 
 	// Returns the nearest multiple of a given number, val, to a given multiple,
 	// mult. Useful for aligning to the nearest value rather than the next.
@@ -152,6 +257,9 @@ private:
 	// Returns alignment from a Bundle 2 size and alignment field.
 	uint16_t GetAlignmentFromSAA(uint32_t data);
 
+	// Returns whether the resource type ID is used by the bundle's format.
+	bool IsKnownResourceType(const Bundle& bundle, uint32_t typeId);
+
 	// Returns the result code of the libdeflate library's
 	// libdeflate_zlib_decompress() function.
 	libdeflate_result GetLibdeflateResult(char* resource, int cmp, int ucmp,
@@ -172,18 +280,83 @@ private:
 	// Connect UI elements to functions.
 	void connectUi();
 
+	// *************************************************************************
+	//                         Pipeline.cpp
+	// *************************************************************************
+
+	// Bundles found in one chunk of the image and everything read about them.
+	// The vectors stop growing once the chunk is scanned, so its bundles can
+	// be worked on by several threads at once.
+	struct BundleBatch
+	{
+		std::vector<FileInfo> info;
+		std::vector<Bundle> bundles;
+		std::vector<QByteArray> debugData;
+		std::vector<std::vector<ResourceEntry>> resources;
+		std::vector<std::vector<std::vector<ImportEntry>>> imports;
+		std::vector<CorruptionType> corrupt;
+		std::vector<uint32_t> hashes;
+		std::vector<BundleBuffer> buffers;
+	};
+
+	// A found bundle waiting to be read
+	struct FoundBundle
+	{
+		BundleBatch* batch;
+		int index;
+	};
+
+	// Finds, reads, validates and extracts bundles all at once, each bundle
+	// being passed on as soon as it is found. Bundles found in each chunk of
+	// the image are kept in its batch.
+	void streamBundles(std::vector<BundleBatch>& batches, uint64_t imgSize);
+
+	// Finds the bundles in a chunk of the image, then queues them to be
+	// worked on. The thread holds a read permit acquired at acquired.
+	void scanChunk(BundleBatch& batch, uint64_t start, uint64_t end,
+		int64_t acquired, BoundedQueue<FoundBundle>& found, int threadId);
+
+	// Works on a bundle taken from the queue, reading the next queued one
+	// ahead.
+	void recoverBundle(BoundedQueue<FoundBundle>& found,
+		const FoundBundle& bundle, int threadId);
+
+	// Reads and validates a found bundle, then extracts it unless it is left
+	// for the Defragmenter.
+	void recoverFound(const FoundBundle& found, int threadId);
+
+	// Moves the bundles of every batch to the end of the vectors, keeping
+	// them in order of offset.
+	void mergeBatches(std::vector<BundleBatch>& batches,
+		std::vector<FileInfo>& info, std::vector<Bundle>& bundles,
+		std::vector<QByteArray>& debugData,
+		std::vector<std::vector<ResourceEntry>>& resources,
+		std::vector<CorruptionType>& corrupt,
+		std::vector<BundleBuffer>& buffers);
+
+	// Found bundles waiting to be read before the Finder works on them itself
+	static constexpr int pipelineQueueSize = 256;
+
 	// *************************************************************************
 	//                         Finder.cpp
 	// *************************************************************************
 
 	// Finds and saves the start position of bundles. Also saves the magic and
-	// version number.
+	// version number. The thread starts with a read permit acquired at
+	// acquired.
 	void findBundles(std::vector<FileInfo>& info, std::vector<Bundle>& bundles,
-		uint64_t start, uint64_t end, int threadId);
+		uint64_t start, uint64_t end, int64_t acquired, int threadId);
 
 	// Sorts the vectors by offset in ascending order
 	void sortBundles(std::vector<FileInfo>& info, std::vector<Bundle>& bundles);
 
+	// Image scanned by a Finder thread before another may take a turn
+	static constexpr uint64_t scanTurnSize = 0x1000000;
+
+	// Image scanned by one Finder task. Its bundles are passed on once it is
+	// done, so smaller chunks pass them on sooner.
+	static constexpr uint64_t scanChunkSize = 0x4000000;
+
 	// *************************************************************************
 	//                         Reader.cpp
 	// *************************************************************************
@@ -191,32 +364,39 @@ private:
 	// Reads bundle data into vectors for use in validation, defragmentation,
 	// and extraction.
 	void readBundles(std::vector<FileInfo>& info, std::vector<Bundle>& bundles,
-		std::vector<QString>& debugData,
+		std::vector<QByteArray>& debugData,
 		std::vector<std::vector<ResourceEntry>>& resources,
 		int start, int end, int threadId);
 
+	// Reads bundle data into a buffer according to the given fragment info.
+	// Fragments already in the buffer are kept and only new or changed data is
+	// read. If size is larger than the fragments, data following the last
+	// fragment is appended until the buffer reaches that size.
+	void readBundleData(QIODevice& img, const FileInfo& info, BundleBuffer& buffer,
+		int size = 0);
+
 	// Reads bundle header data.
-	void readHeaders(QFile& img, const FileInfo& info, Bundle& bundle);
+	void readHeaders(QIODevice& img, const FileInfo& info, Bundle& bundle);
 
 	// Reads Bundle 2 debug data (ResourceStringTable XML data).
-	void readDebugData(QFile& img, const FileInfo& info, const Bundle& bundle,
-		QString& debugData);
+	void readDebugData(QIODevice& img, const FileInfo& info, const Bundle& bundle,
+		QByteArray& debugData);
 
 	// Reads Bundle 1 resource IDs.
-	void readResourceIds(QFile& img, const FileInfo& info, const Bundle& bundle,
+	void readResourceIds(QIODevice& img, const FileInfo& info, const Bundle& bundle,
 		std::vector<ResourceEntry>& resources);
 
 	// Reads bundle resource entries.
-	void readResourceEntries(QFile& img, const FileInfo& info,
+	void readResourceEntries(QIODevice& img, const FileInfo& info,
 		const Bundle& bundle, std::vector<ResourceEntry>& resources);
 
 	// Reads Bundle 1 resource compression information.
-	void readResourceCompressionInfo(QFile& img, const FileInfo& info,
+	void readResourceCompressionInfo(QIODevice& img, const FileInfo& info,
 		const Bundle& bundle, std::vector<ResourceEntry>& resources);
 
 	// Reads Bundle 1 resource imports using valid resource entries.
 	// TODO: if (magic == bndl && importsOffset != 0) in validation
-	void readResourceImports(QFile& img, const FileInfo& info,
+	void readResourceImports(QIODevice& img, const FileInfo& info,
 		const Bundle& bundle, std::vector<ResourceEntry>& resources,
 		std::vector<std::vector<ImportEntry>>& imports);
 
@@ -224,22 +404,26 @@ private:
 	//                         Validator.cpp
 	// *************************************************************************
 
-	// Finds corrupt bundles and sets their corruption type.
+	// Finds corrupt bundles and sets their corruption type. The data read of
+	// bundles with corrupt compressed data is kept in their buffers for the
+	// Defragmenter.
 	void validateBundles(std::vector<FileInfo>& info,
-		std::vector<Bundle>& bundles, std::vector<QString>& debugData,
+		std::vector<Bundle>& bundles, std::vector<QByteArray>& debugData,
 		std::vector<std::vector<ResourceEntry>>& resources,
 		std::vector<std::vector<std::vector<ImportEntry>>>& imports,
-		std::vector<CorruptionType>& corrupt, int start, int end,
-		int threadId);
+		std::vector<CorruptionType>& corrupt, std::vector<uint32_t>& hashes,
+		std::vector<BundleBuffer>& buffers, int start, int end, int threadId);
 
-	void validateSingleBundle(QFile& img, FileInfo& info, Bundle& bundle,
-		QString& debugData, std::vector<ResourceEntry>& resources,
+	void validateSingleBundle(QIODevice& img, FileInfo& info, Bundle& bundle,
+		BundleBuffer& buffer, QByteArray& debugData,
+		std::vector<ResourceEntry>& resources,
 		std::vector<std::vector<ImportEntry>>& imports,
 		CorruptionType& corrupt);
 
-	// Returns the position, relative to the start of the bundle, the XML reader
-	// fails at while reading bundle debug data. 0 if the debug data is valid.
-	int getDebugDataFailPos(const Bundle& bundle, const QString& debugData);
+	// Returns the position, relative to the start of the bundle, the XML
+	// checker fails at while reading bundle debug data. 0 if the debug data is
+	// valid.
+	int getDebugDataFailPos(const Bundle& bundle, const QByteArray& debugData);
 
 	// Returns the position, relative to the start of the bundle, of the first
 	// corrupt resource ID. 0 if all resource IDs are valid.
@@ -251,6 +435,15 @@ private:
 	int getResourceEntriesFailPos(const Bundle& bundle,
 		const std::vector<ResourceEntry>& resources);
 
+	// Returns the index of the first Bundle 2 resource entry from first to
+	// count that fails a check in getResourceEntriesFailPos, reading the
+	// entries from raw bundle data. -1 if none fail.
+	int getRawResourceEntriesFailIndex(const Bundle& bundle,
+		const char* entries, int first, int count);
+
+	// Raw resource entries checked together before checking any one further
+	static constexpr int rawEntryBatchSize = 8;
+
 	// Returns the position, relative to the start of the bundle, of the first
 	// corrupt compression info entry. 0 if all compression info is valid.
 	int getResourceCompressionInfoFailPos(const Bundle& bundle,
@@ -263,38 +456,204 @@ private:
 
 	// Returns whether there is a corrupt resource in the specified compressed
 	// bundle.
-	bool validateCompressedResources(QFile& img, const FileInfo& info,
+	bool validateCompressedResources(const BundleBuffer& buffer,
 		const Bundle& bundle, const std::vector<ResourceEntry>& resources);
 
 	// Returns the position, relative to the start of the bundle, of the point
 	// of corruption. This may be inaccurate; steps should be taken to mitigate
 	// any potential error that may arise.
-	int getCompressedResourcesFailPos(QFile& img, const FileInfo& info,
+	int getCompressedResourcesFailPos(const BundleBuffer& buffer,
 		const Bundle& bundle, const std::vector<ResourceEntry>& resources);
 
+	// Returns the position, relative to the start of the bundle, of the point
+	// of corruption in the compressed resource at resourcePos. 0 if the
+	// resource is valid.
+	int getCompressedResourceFailPos(const BundleBuffer& buffer,
+		int resourcePos, int cSz, int uSz);
+
+	// Checks the compressed resources of a Bundle 2 bundle in order, skipping
+	// those marked in valid which end before the bundle offset from. Resources
+	// which decompress are marked in valid, indexed by chunk then resource.
+	// Returns false and the first corrupt resource if there is one.
+	bool checkCompressedResources(const BundleBuffer& buffer,
+		const Bundle& bundle, const std::vector<ResourceEntry>& resources,
+		std::vector<bool>& valid, int from, int& resourceIndex,
+		int& chunkIndex);
+
 	// *************************************************************************
 	//                         Defragmenter.cpp
 	// *************************************************************************
 
-	// Attempts to defragments bundles marked as corrupt
-	void defragBundles(std::vector<FileInfo>& info,
-		const std::vector<Bundle>& bundles, std::vector<QString>& debugData,
+	// Defragments the bundles in the queue on a thread per core, taking them
+	// in queue order. Bundles which run out of their time budget (seconds, 0
+	// for none) are set aside and resumed without a limit after the rest.
+	// Bundles left intact are extracted straight away if extracting.
+	void defragQueue(std::vector<FileInfo>& info,
+		const std::vector<Bundle>& bundles, std::vector<QByteArray>& debugData,
 		std::vector<std::vector<ResourceEntry>>& resources,
-		const std::vector<std::vector<std::vector<ImportEntry>>>& imports,
-		std::vector<CorruptionType>& corrupt, int start, int end, int threadId);
-
-	void defragDebugData(QFile& img, FileInfo& info, const Bundle& bundle,
-		QString& debugData, std::vector<ResourceEntry>& resources,
-		CorruptionType& corrupt, bool& breakLoop, int threadId);
-
-	void defragResourceEntriesBnd2(QFile& img, FileInfo& info,
-		const Bundle& bundle, std::vector<ResourceEntry>& resources,
-		CorruptionType& corrupt, bool& breakLoop, int threadId);
+		std::vector<CorruptionType>& corrupt,
+		std::vector<BundleBuffer>& buffers, const std::vector<int>& queue,
+		int budget);
+
+	// Returns the indices of the corrupt bundles, cheapest and most likely to
+	// be defragmented first.
+	std::vector<int> getDefragQueue(const std::vector<FileInfo>& info,
+		const std::vector<Bundle>& bundles,
+		const std::vector<std::vector<ResourceEntry>>& resources,
+		const std::vector<CorruptionType>& corrupt);
+
+	// Returns how likely the missing bytes of a bundle are to be found near
+	// its last fragment, from 1 to 100, going by the share of sectors needed
+	// for them that the search could find there.
+	int getDefragLikelihood(const FileInfo& info, CorruptionType corrupt,
+		int64_t missing);
+
+	// Attempts to defragment the bundle at index i, starting from the data
+	// validation read into its buffer. Returns false if it was stopped at the
+	// deadline (milliseconds since the epoch, 0 for none).
+	bool defragBundle(QIODevice& img, std::vector<FileInfo>& info,
+		const std::vector<Bundle>& bundles, std::vector<QByteArray>& debugData,
+		std::vector<std::vector<ResourceEntry>>& resources,
+		std::vector<CorruptionType>& corrupt,
+		std::vector<BundleBuffer>& buffers, int i, int64_t deadline,
+		int threadId);
 
-	void defragZlibData(QFile& img, std::vector<FileInfo>& info,
-		const Bundle& bundle, const std::vector<ResourceEntry>& resources,
-		CorruptionType& corrupt, int& prevResource, int& prevChunk,
-		bool& breakLoop, bool& searchedAll, int p, int threadId);
+	// Returns whether the deadline has passed.
+	static bool pastDeadline(int64_t deadline);
+
+	// Claims the sectors of the first count fragments of a bundle, so they are
+	// not searched for other bundles' fragments
+	void claimFragments(const FileInfo& info, int count);
+
+	// Returns the order to try candidates for the fragment following the one
+	// at fragmentPos, from the forward window [start, end) and an equally
+	// sized backward window below fragmentPos.
+	CandidateOrder getCandidateOrder(uint64_t start, uint64_t end,
+		uint64_t fragmentPos);
+
+	// Returns whether a fragment with the content, of which size bytes
+	// remain, could start at the offset. Sectors claimed by a bundle or
+	// whose contents don't match are skipped without being read.
+	bool isFragmentCandidate(uint64_t offset, SectorMap::Content content,
+		int size);
+
+	// Reads the bundle's fragments, each rounded up to whole sectors, into the
+	// buffer, followed by size bytes of the data after the last.
+	void readKnownData(QIODevice& img, const FileInfo& info,
+		BundleBuffer& buffer, int size);
+
+	void defragDebugData(QIODevice& img, FileInfo& info, const Bundle& bundle,
+		BundleBuffer& buffer, QByteArray& debugData,
+		std::vector<ResourceEntry>& resources, CorruptionType& corrupt,
+		bool& breakLoop, int threadId);
+
+	void defragResourceEntriesBnd2(QIODevice& img, FileInfo& info,
+		const Bundle& bundle, BundleBuffer& buffer,
+		std::vector<ResourceEntry>& resources, CorruptionType& corrupt,
+		bool& breakLoop, int threadId);
+
+	// Searches for the fragments of a bundle with zlib data corruption,
+	// keeping up to beamWidth of the best scoring chains after each fragment.
+	// If no chain can be completed within the search length and the whole
+	// image is to be searched, a search continuing the best chain is queued in
+	// zlibQueries and deferred is set.
+	// Returns false, leaving the bundle as it was, if the deadline passed. The
+	// search is then kept in zlibSearches and resumed on the next call.
+	bool defragZlibData(QIODevice& img, FileInfo& info, const Bundle& bundle,
+		BundleBuffer& buffer, const std::vector<ResourceEntry>& resources,
+		CorruptionType& corrupt, bool& deferred, int bundleIndex,
+		int64_t deadline, int threadId);
+
+	// Adds up to beamWidth chains continuing the hypothesis past its first
+	// corrupt resource to children. If there are none, the hypothesis' query
+	// is set up to search the whole image instead. Returns false if the
+	// deadline passed, in which case calling again with the same children
+	// resumes the search.
+	bool expandZlibHypothesis(QIODevice& img, ZlibHypothesis& hypothesis,
+		std::vector<ZlibHypothesis>& children, const Bundle& bundle,
+		const std::vector<ResourceEntry>& resources, int intendedSize,
+		int64_t deadline, int threadId);
+
+	// Returns whether hypothesis a scores higher than b.
+	static bool isBetterHypothesis(const ZlibHypothesis& a,
+		const ZlibHypothesis& b);
+
+
+	// Adds the fragment at the image offset which continues the bundle from
+	// the truncation point, then checks the resources from there on for
+	// further corruption
+	void applyZlibFragment(QIODevice& img, FileInfo& info, const Bundle& bundle,
+		BundleBuffer& buffer, const std::vector<ResourceEntry>& resources,
+		std::vector<bool>& validResources, CorruptionType& corrupt,
+		int truncation, uint64_t offset, int intendedSize, int threadId);
+
+	// Returns the bundle offsets of compressed resources starting between end
+	// and the next multiple of the interval. These are in the same sector as
+	// data ending at end, so any fragment continuing that data has their zlib
+	// headers at known positions.
+	std::vector<int> getZlibAnchors(const Bundle& bundle,
+		const std::vector<ResourceEntry>& resources, int end);
+
+	// Returns whether a candidate fragment at the offset may have zlib
+	// headers at every anchor, given relative to the offset.
+	bool hasZlibAnchors(uint64_t offset, const std::vector<int>& anchors);
+
+	// Tests size bytes of a candidate continuation against the inflater, or
+	// only probes them if probe is set. Results are reused for identical data
+	// tested against the same state, and lookups are counted in the totals.
+	bool testZlibCandidate(const Inflater& inflater, const char* data,
+		int size, bool probe, uint64_t state, std::vector<Bytef>& scratch,
+		uint64_t& lookups, uint64_t& hits);
+
+	// Returns the first count image offsets in the order at which size bytes
+	// complete the resource prefix decoded by the inflater. Candidates
+	// without zlib headers at the anchors are skipped. The candidates are
+	// searched in chunks on every idle thread, and the search stops early if
+	// the deadline passes.
+	std::vector<uint64_t> findZlibContinuations(const Inflater& inflater,
+		const CandidateOrder& order, int size, const std::vector<int>& anchors,
+		int count, int64_t deadline);
+
+	// Searches the whole image for every query in one pass per batch,
+	// setting the truncation point and offset of each match
+	void searchZlibQueries(std::vector<ZlibQuery>& queries);
+
+	// Applies the results of whole-image searches. Returns the indices of
+	// bundles which need further defragmentation.
+	std::vector<int> applyZlibQueries(const std::vector<ZlibQuery>& queries,
+		std::vector<FileInfo>& info, const std::vector<Bundle>& bundles,
+		const std::vector<std::vector<ResourceEntry>>& resources,
+		std::vector<CorruptionType>& corrupt,
+		std::vector<BundleBuffer>& buffers);
+
+	// Image data kept in memory for reading again
+	static constexpr uint64_t imageCacheSize = 0x20000000;
+
+	// Image data read ahead from each side of a fragment's candidate window
+	static constexpr uint64_t prefetchWindowSize = 0x1000000;
+
+	// Zlib candidate results remembered at once, 8 bytes each
+	static constexpr uint64_t continuationMemoSize = 0x100000;
+
+	// Most common gaps between fragments to try before all others
+	static constexpr int likelyGapCount = 8;
+
+	// Sectors sampled near a bundle to estimate its chances of being
+	// defragmented
+	static constexpr uint64_t likelihoodSamples = 0x1000;
+
+	// Candidate offsets given to a thread at a time in a fragment search,
+	// checking for cancelling and the deadline before each chunk
+	static constexpr uint64_t candidatesPerChunk = 0x400;
+
+	// Data decoded from a zlib candidate before reading all of it
+	static constexpr int zlibProbeSize = 0x1000;
+
+	// Memory allowed for saved inflate states in one whole-image pass
+	static constexpr uint64_t zlibBatchMemory = 0x10000000;
+
+	// Image data read at a time in a whole-image pass
+	static constexpr uint64_t zlibSweepBlockSize = 0x4000000;
 
 	// *************************************************************************
 	//                         Extractor.cpp
@@ -308,6 +667,76 @@ private:
 	// Get the name of the bundle from known resource IDs matched to file names
 	QString bundleName(const FileInfo& info, CorruptionType corrupt);
 
+	// *************************************************************************
+	//                         Session.cpp
+	// *************************************************************************
+
+	// Returns the path of the journal recovery progress on the input image is
+	// saved to between runs.
+	QString sessionPath();
+
+	// Returns a key identifying the input image and the settings that affect
+	// validation results.
+	QString imageKey();
+
+	// Returns a CRC-32 hash of everything in the bundle preceding the resource
+	// data, used to detect whether a bundle changed since it was validated.
+	uint32_t getMetadataHash(QIODevice& img, const FileInfo& info,
+		const Bundle& bundle);
+
+	// Opens the journal for the input image and replays the scan progress of
+	// previous runs.
+	void loadCheckpoint();
+
+	// Indexes the journal so the next stage or run can look up results
+	// without replaying it.
+	void saveCheckpoint();
+
+	// Returns the sorted image ranges scanned by previous runs.
+	std::vector<std::pair<uint64_t, uint64_t>> getScannedRanges();
+
+	// Merges a scanned range into the checkpoint. The checkpoint mutex must
+	// be held.
+	void mergeScanned(uint64_t start, uint64_t end);
+
+	// Records an image range as completely scanned.
+	void recordScanned(uint64_t start, uint64_t end);
+
+	// Records a bundle found by the Finder.
+	void recordFound(uint64_t offset, const Bundle& bundle);
+
+	// Adds bundles between start and end found in completely scanned ranges
+	// by previous runs.
+	void resumeFound(std::vector<FileInfo>& info, std::vector<Bundle>& bundles,
+		uint64_t start, uint64_t end);
+
+	// Version of the checks validation runs. Increment it whenever they change
+	// which bundles pass, so results saved by earlier versions are redone.
+	static constexpr uint16_t validatorVersion = 1;
+
+	// Applies the cached validation result for a bundle. Returns false if
+	// there is none, the bundle has changed since it was saved, or it was
+	// saved by another version of the validator.
+	bool applyCachedValidation(FileInfo& info, uint32_t hash,
+		CorruptionType& corrupt);
+
+	// Records the validation result of a bundle.
+	void recordValidation(const FileInfo& info, uint32_t hash,
+		CorruptionType corrupt);
+
+	// Applies the saved defragmentation result for a bundle. Returns false if
+	// there is none.
+	bool applyDefragCheckpoint(FileInfo& info, CorruptionType& corrupt);
+
+	// Records the defragmentation result of a bundle.
+	void recordDefrag(const FileInfo& info, CorruptionType corrupt);
+
+	// Returns whether the bundle was already extracted to the output path.
+	bool isExtracted(const FileInfo& info, const QString& path);
+
+	// Records a bundle as extracted to the output path.
+	void recordExtracted(const FileInfo& info, const QString& path);
+
 private slots:
 	void selectInputFile();
 	void selectOutputFolder();
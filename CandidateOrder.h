@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <QMutex>
+
+// Sizes of the gaps between fragments found so far in a run, used to try the
+// most common gaps first when searching for the next fragment.
+class GapModel
+{
+public:
+	// Records the gap from where a fragment would be if the data were
+	// contiguous to where it was found.
+	void record(int64_t gap);
+
+	// Returns up to count of the most common gaps, most common first.
+	std::vector<int64_t> likely(int count);
+
+	void clear();
+
+private:
+	QMutex mutex;
+	std::map<int64_t, int> counts;
+};
+
+// Order in which to try candidate fragment offsets.
+//
+// Gaps between fragments are usually small and forward, so candidates in the
+// forward window [start, end) and the backward window below backStart, down
+// to backEnd, are tried nearest to start first, forward first at equal
+// distances. Offsets at gaps that were common earlier in the run are tried
+// before all of them, and not again in the windows.
+class CandidateOrder
+{
+public:
+	CandidateOrder(uint64_t start, uint64_t end, uint64_t backStart,
+		uint64_t backEnd, int interval, const std::vector<int64_t>& likelyGaps);
+
+	// Returns the number of candidates.
+	uint64_t size() const;
+
+	// Returns the offset of the candidate to try at the rank.
+	uint64_t at(uint64_t rank) const;
+
+private:
+	// Returns the offset of the window candidate at the rank, counting the
+	// likely offsets in the windows.
+	uint64_t windowAt(uint64_t rank) const;
+
+	// Returns whether the offset is a window candidate, setting rank to its
+	// rank if so.
+	bool windowRank(uint64_t offset, uint64_t& rank) const;
+
+	uint64_t start;
+	uint64_t backStart;
+	int interval;
+	uint64_t forwardCount; // Candidates in the forward window
+	uint64_t backwardCount; // Candidates in the backward window
+	uint64_t leadCount; // Forward candidates nearer than any backward one
+	uint64_t pairCount; // Backward and forward pairs after the lead
+	std::vector<uint64_t> likely; // Offsets tried first
+	std::vector<uint64_t> skipped; // Window ranks of the likely offsets, sorted
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Bitmap of image sectors that belong to a bundle, which can't be part of
+// another bundle's missing data.
+//
+// Sectors are claimed by intact bundles after validation and by fragments
+// once the defragmenter settles their size. Claims and lookups are atomic,
+// so all threads share one map.
+class ClaimedSectors
+{
+public:
+	// Clears the map for an image of the size with sectors of the interval.
+	void reset(uint64_t imageSize, int interval);
+
+	// Claims every sector overlapping [pos, pos + size).
+	void claim(uint64_t pos, uint64_t size);
+
+	// Returns whether the sector at the offset is claimed.
+	bool isClaimed(uint64_t offset) const;
+
+	// Returns the number of claimed sectors.
+	uint64_t count() const;
+
+private:
+	std::unique_ptr<std::atomic<uint64_t>[]> words;
+	uint64_t wordCount = 0;
+	uint64_t sectors = 0;
+	int interval = 1;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+
+#include <QMutex>
+#include <QWaitCondition>
+
+// Number of threads allowed to work at once on one kind of work, adjusted
+// while they work to get the most done.
+//
+// Threads hold a permit while working, and report the work done in bytes
+// when they give it back. Once per period the work done per second
+// is compared with the period before: if it did not get worse the limit
+// takes another step in the same direction, otherwise it turns back. Disks
+// which have to seek settle on few threads and processors on many.
+class ConcurrencyController
+{
+public:
+	// A permit held for a scope, given back with the work done when it ends.
+	class Permit
+	{
+	public:
+		Permit(ConcurrencyController& controller, uint64_t work);
+		~Permit();
+
+	private:
+		ConcurrencyController& controller;
+		uint64_t work;
+		int64_t acquired;
+	};
+
+	// Starts over for a new stage, allowing initial threads at once and never
+	// more than maximum.
+	void reset(int initial, int maximum);
+
+	// Waits until the thread may work. Returns when it started, to be passed
+	// to release().
+	int64_t acquire();
+
+	// Lets the thread work if it may without waiting, setting acquired to
+	// when it started. Returns whether it may.
+	bool tryAcquire(int64_t& acquired);
+
+	// Ends the work of a thread which started at acquired and did the amount
+	// of work.
+	void release(int64_t acquired, uint64_t work);
+
+	// Gives back the permit of a thread which found no work to do, without
+	// counting it.
+	void release();
+
+	// Counts the amount of work done since started by a thread without a
+	// permit, such as one serving the reads of others.
+	void record(int64_t started, uint64_t work);
+
+	// Returns the current time in microseconds.
+	static int64_t now();
+
+	// Returns the number of threads allowed to work at once.
+	int limit();
+
+	// Returns the work done per second over the stage.
+	double throughput();
+
+	// Returns the average time in milliseconds threads held a permit or took
+	// for recorded work.
+	double latency();
+
+	// Milliseconds between adjustments of the limit
+	static constexpr int64_t period = 1000;
+
+private:
+	// Adds work done from started until time to the totals.
+	void count(int64_t started, int64_t time, uint64_t work);
+
+	// Moves the limit a step if a period has passed.
+	void adjust(int64_t time);
+
+	QMutex mutex;
+	QWaitCondition permitFreed;
+	int current = 1; // Threads allowed at once
+	int maximum = 1;
+	int active = 0; // Threads holding a permit
+	int direction = 1; // Next step of the limit, up or down
+	int64_t started = 0; // Start of the stage
+	int64_t periodStart = 0;
+	uint64_t periodWork = 0;
+	double lastThroughput = 0; // Work per second in the last period
+	uint64_t totalWork = 0;
+	uint64_t permits = 0; // Permits given back with work, and work recorded
+	int64_t held = 0; // Total time of those
+};
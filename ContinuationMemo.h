@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Bounded table of fragment candidate results, keyed by a hash of the
+// candidate's data and the state it was tested against.
+//
+// Images hold many identical sectors, such as duplicated bundles, so the same
+// bytes are often tested against the same resource prefix at several offsets.
+// Each slot holds one key and its result in a single atomic word, so all
+// threads share the table without locking. A new key replaces whatever is in
+// its slot, which bounds the table's size.
+class ContinuationMemo
+{
+public:
+	// Clears the table, sizing it to hold capacity results. The capacity must
+	// be a power of two.
+	void reset(uint64_t capacity);
+
+	// Returns a key for size bytes of data tested against the state.
+	static uint64_t key(const char* data, int size, uint64_t state);
+
+	// Returns whether a result is known for the key, setting result if so.
+	bool find(uint64_t key, bool& result) const;
+
+	void insert(uint64_t key, bool result);
+
+	// Adds lookups made by a thread to the statistics.
+	void count(uint64_t lookups, uint64_t hits);
+
+	uint64_t lookups() const;
+	uint64_t hits() const;
+
+private:
+	std::unique_ptr<std::atomic<uint64_t>[]> entries;
+	uint64_t mask = 0;
+	std::atomic<uint64_t> lookupCount = 0;
+	std::atomic<uint64_t> hitCount = 0;
+};
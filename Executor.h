@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+// Threads kept for the whole run, which every stage gives its tasks to.
+//
+// Each thread has its own queue of tasks. Tasks are dealt out in turn, so
+// every queue holds its tasks in order, and a thread whose queue runs out
+// takes the last task of the fullest queue. Tasks that take much longer than
+// others don't leave threads idle at the end of a stage.
+class Executor
+{
+public:
+	~Executor();
+
+	// Starts the threads, stopping any already running.
+	void start(int threadCount);
+
+	// Waits for the running tasks, then stops the threads.
+	void stop();
+
+	// Returns the number of threads.
+	int size() const;
+
+	// Runs the task once for every index from 0 to count, passing the index and
+	// the thread running it, from 0 to size(). Returns once all have finished.
+	// When called from a task, its thread works on the new tasks meanwhile,
+	// and idle threads help it.
+	void run(int count, const std::function<void(int, int)>& task);
+
+private:
+	// Tasks given by one call to run
+	struct Batch
+	{
+		const std::function<void(int, int)>* task;
+		std::atomic<int> remaining; // Not yet finished
+	};
+
+	struct Job
+	{
+		Batch* batch;
+		int index;
+	};
+
+	struct Queue
+	{
+		QMutex mutex;
+		std::deque<Job> jobs;
+	};
+
+	// Runs tasks on the thread until stopped.
+	void work(int thread);
+
+	// Takes the next task of the thread's queue, or the last of the fullest
+	// other queue. Returns false once there are none.
+	bool take(int thread, Job& job);
+
+	// Takes a task of the batch from any queue. Returns false once there are
+	// none.
+	bool takeFrom(const Batch& batch, Job& job);
+
+	// Runs the task, waking the caller of run if it was the batch's last.
+	void finish(const Job& job, int thread);
+
+	std::vector<QThread*> threads;
+	std::vector<std::unique_ptr<Queue>> queues; // One per thread
+	QMutex mutex;
+	QWaitCondition tasksQueued;
+	QWaitCondition tasksDone;
+	std::atomic<int> queued = 0; // Tasks in the queues
+	bool stopping = false;
+};
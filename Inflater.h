@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+
+#include <QtZlib/zlib.h>
+
+// Decodes a zlib stream whose beginning is known and whose continuation is
+// being searched for.
+//
+// The known prefix is inflated once and the decoder state at its end (bit
+// position, window, and partially decoded block) is kept. Each candidate
+// continuation is tested by decoding only its own bytes from a copy of that
+// state, rather than decompressing the whole resource again.
+class Inflater
+{
+public:
+	Inflater();
+	// Copies the decoder state, so a prefix can be decoded once and kept at
+	// several truncation points.
+	Inflater(const Inflater& other);
+	~Inflater();
+
+	Inflater& operator=(const Inflater&) = delete;
+
+	// Starts a new stream that inflates to the uncompressed size.
+	void reset(int uncompressedSize);
+
+	// Decodes the stream up to size bytes of data, which starts at the
+	// beginning of the stream. Only bytes past those already decoded are
+	// inflated unless size is smaller. Returns false if the prefix is invalid.
+	bool advance(const char* data, int size);
+
+	// Returns whether the prefix followed by the continuation inflates to
+	// exactly the uncompressed size with a matching checksum.
+	bool test(const char* continuation, int size);
+
+	// As above, decoding into the caller's scratch space so several threads
+	// can test continuations of the same prefix at once.
+	bool test(const char* continuation, int size,
+		std::vector<Bytef>& scratch) const;
+
+	// Decodes only the start of a continuation, returning false if it
+	// already makes the stream invalid. Most wrong continuations fail within
+	// a few KB, so this is used to reject them before reading and decoding
+	// all of their data with test().
+	bool probe(const char* continuation, int size,
+		std::vector<Bytef>& scratch) const;
+
+	// Returns the approximate memory used by the saved decoder state.
+	static constexpr int stateSize = 0xA000;
+
+private:
+	z_stream base = {}; // State at the end of the prefix
+	bool initialized = false;
+	bool valid = false; // Prefix has no errors
+	bool ended = false; // Stream ended within the prefix
+	int consumed = 0; // Prefix bytes decoded
+	int uncompressedSize = 0;
+	std::vector<Bytef> output; // Scratch space, contents are never used
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ConcurrencyController.h"
+
+#include <cstdint>
+#include <map>
+
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <QWaitCondition>
+
+// Positional reads of a file, served in order of offset on rotational disks.
+//
+// Threads reading unrelated offsets of an image on a hard disk make it seek
+// back and forth between them. When scheduling, reads from every thread are
+// queued and served by one thread in sweeps of ascending offset, each
+// starting from where the last read ended and taking up to the queue depth
+// of reads. Otherwise reads are done by the calling thread, as many at once
+// as a controller allows.
+class IoScheduler
+{
+public:
+	~IoScheduler();
+
+	// Starts serving reads of the native file handle. Reads are scheduled if
+	// queueDepth is not 0, and done directly otherwise, limited by the
+	// controller if there is one.
+	void start(intptr_t handle, int queueDepth,
+		ConcurrencyController* controller);
+
+	// Serves every queued read, then stops.
+	void stop();
+
+	// Returns whether reads are scheduled.
+	bool isScheduled() const;
+
+	// Reads size bytes at the offset into data. Returns the number of bytes
+	// read, or -1 if nothing could be read.
+	int64_t read(uint64_t offset, char* data, int64_t size);
+
+	// Returns whether the file at the path is on a disk which has to seek,
+	// where that can be found out.
+	static bool isRotational(const QString& path);
+
+private:
+	struct Request
+	{
+		uint64_t offset;
+		char* data;
+		int64_t size;
+		int64_t result;
+		bool done;
+	};
+
+	// Reads from the file in the calling thread.
+	int64_t readAt(uint64_t offset, char* data, int64_t size);
+
+	// Serves queued reads until stopped.
+	void run();
+
+	intptr_t handle = -1;
+	int queueDepth = 0;
+	ConcurrencyController* controller = nullptr;
+	QThread* thread = nullptr;
+	QMutex mutex;
+	QWaitCondition queued;
+	QWaitCondition served;
+	std::multimap<uint64_t, Request*> requests; // Keyed by offset
+	uint64_t head = 0; // Where the last read ended
+	bool stopping = false;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+#include <QFile>
+#include <QMutex>
+#include <QString>
+
+// Append-only binary log of recovery progress for one image.
+//
+// The journal is a 32-byte header followed by fixed-size 32-byte records,
+// written as soon as results are produced so an interrupted run loses at most
+// the record being written. A separate index file maps each bundle offset to
+// its latest Validated, Defragged, and Extracted records. Both files are
+// memory-mapped, so lookups do not hold every result in memory. Records
+// appended since the index was last built are looked up in a small in-memory
+// table instead.
+class Journal
+{
+public:
+	enum class RecordType : uint8_t
+	{
+		// Image range [offset, data[0]) fully scanned.
+		// state: version limit searched for
+		Scanned,
+		// Bundle at offset. value: magic, count: version,
+		// state: version limit searched for
+		Found,
+		// Validation result. value: metadata hash, state: corruption type,
+		// count: validator version, data[0]: bundle size,
+		// data[1]: fail position
+		Validated,
+		// Defragmentation result, followed by count Fragment records.
+		// state: corruption type, value: search whole image,
+		// data[0]: search length, data[1]: beam width
+		Defragged,
+		// Fragment of the preceding Defragged record's bundle.
+		// data[0]: position, data[1]: size
+		Fragment,
+		// Bundle extracted. value: CRC-32 of the output path
+		Extracted
+	};
+
+	struct Record
+	{
+		RecordType type;
+		uint8_t state;
+		uint16_t count;
+		uint32_t value;
+		uint64_t offset;
+		uint64_t data[2];
+	};
+	static_assert(sizeof(Record) == 32);
+
+	static constexpr uint32_t noRecord = 0xFFFFFFFF;
+
+	~Journal();
+
+	// Opens the journal at the path, creating it if it does not exist or
+	// belongs to a different image. Returns false if it can't be opened.
+	bool open(const QString& path, uint32_t imageHash);
+
+	// Opens an existing journal for reading only, regardless of its image.
+	bool openReadOnly(const QString& path);
+
+	void close();
+
+	// Appends records as a single contiguous block.
+	void append(const Record* records, int count);
+
+	// Returns the number of records in the journal.
+	int64_t size();
+
+	// Returns the record at the index.
+	Record at(int64_t index);
+
+	// Finds the latest record of the type (Validated, Defragged, or
+	// Extracted) for the bundle at the offset. Returns false if there is none.
+	bool find(uint64_t offset, RecordType type, int64_t& index);
+
+	// Calls the function for every record in order. The journal is locked
+	// meanwhile, so the function must not use it.
+	void forEach(const std::function<void(int64_t, const Record&)>& function);
+
+	// Rewrites the index file to cover every record in the journal.
+	void buildIndex();
+
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t imageHash;
+		uint32_t reserved[5];
+	};
+	static_assert(sizeof(Header) == 32);
+
+	struct IndexHeader
+	{
+		char magic[4];
+		uint32_t reserved;
+		uint64_t recordCount;
+	};
+
+	struct IndexEntry
+	{
+		uint64_t offset;
+		uint32_t records[3]; // Validated, Defragged, Extracted
+		uint32_t reserved;
+	};
+	static_assert(sizeof(IndexEntry) == 24);
+
+	// Returns the slot in IndexEntry::records for the type, or -1.
+	static int indexSlot(RecordType type);
+
+	// Records the record as the latest of its type for its bundle.
+	static void addEntry(std::unordered_map<uint64_t, IndexEntry>& entries,
+		int64_t index, const Record& record);
+
+	// Calls the function for every record in order. The mutex must be held.
+	void read(const std::function<void(int64_t, const Record&)>& function);
+
+	// Maps the journal and index files into memory.
+	void map();
+	void unmap();
+
+	QMutex mutex;
+	QFile file;
+	QFile indexFile;
+	QString indexPath;
+	int64_t count = 0; // Records in the journal
+	int64_t indexedCount = 0; // Records covered by the index
+	uchar* mappedRecords = nullptr;
+	uchar* mappedIndex = nullptr;
+	int64_t indexEntries = 0;
+	// Latest records not yet covered by the index, keyed by bundle offset
+	std::unordered_map<uint64_t, IndexEntry> recent;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "BlockCache.h"
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+#include <QFileDevice>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
+
+// Reads ranges of an image into a block cache on a thread of its own, ahead
+// of the threads that will use them, and tells the OS how ranges of the image
+// will be read.
+class Prefetcher
+{
+public:
+	// How a range of a file will be read
+	enum class Access
+	{
+		Normal,
+		Sequential, // In ascending order, once
+		Random,
+		WillNeed // Soon
+	};
+
+	~Prefetcher();
+
+	// Starts reading queued ranges into the cache.
+	void start(BlockCache& cache);
+
+	// Stops reading and drops every queued range.
+	void stop();
+
+	// Queues the range to be read into the cache. The newest range is read
+	// first, and once more than maxQueued bytes are queued, the oldest ranges
+	// are dropped.
+	void prefetch(uint64_t offset, uint64_t size);
+
+	// Tells the OS how the range of the file will be read. Does nothing where
+	// there is no way to.
+	static void advise(const QFileDevice& file, uint64_t offset, uint64_t size,
+		Access access);
+
+	static constexpr uint64_t maxQueued = 0x8000000;
+
+private:
+	// Reads queued ranges until stopped.
+	void run();
+
+	BlockCache* cache = nullptr;
+	QThread* thread = nullptr;
+	QMutex mutex;
+	QWaitCondition queuedRange;
+	std::deque<std::pair<uint64_t, uint64_t>> ranges; // Offsets and sizes
+	uint64_t queued = 0; // Bytes in ranges
+	bool stopping = false;
+};
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Compile-time table of known resource type IDs, used to reject corrupt
+// resource entries before any resource data is inflated.
+//
+// Bundle 1 (Black, Burnout Paradise prototypes) and Bundle 2 v2/v3 (Burnout
+// Paradise) share one set of type IDs. Membership is checked with a perfect
+// hash whose multiplier is searched for at compile time, so a lookup is a
+// multiply, a shift, and a single comparison.
+//
+// The rendering and audio ranges aren't fully documented, so every ID in them
+// up to the highest one seen is listed rather than only the documented ones.
+namespace ResourceTypes
+{
+	// Bundle 1 and Bundle 2 v2/v3 resource type IDs
+	constexpr uint32_t bundle2Types[] =
+	{
+		// Rendering
+		0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0xA, 0xB, 0xC,
+		0xD, 0xE, 0xF, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18,
+		0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B,
+		0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32,
+		0x41, 0x42, 0x43, 0x45, 0x46,
+		0x50, 0x51,
+
+		// Black
+		0x2710, 0x2711, 0x343E, 0x343F, 0x3A98,
+
+		// Audio
+		0xA000, 0xA001, 0xA002, 0xA003, 0xA004, 0xA005, 0xA006, 0xA007,
+		0xA008, 0xA009, 0xA00A, 0xA00B, 0xA00C, 0xA00D, 0xA00E, 0xA00F,
+		0xA010, 0xA011, 0xA012, 0xA013, 0xA014, 0xA015, 0xA016, 0xA017,
+		0xA018, 0xA019, 0xA01A, 0xA01B, 0xA01C, 0xA01D, 0xA01E, 0xA01F,
+		0xA020, 0xA021, 0xA022, 0xA023, 0xA024, 0xA025, 0xA026, 0xA027,
+		0xA028, 0xA029,
+		0xB000,
+
+		// Burnout Paradise game data
+		0x10000, 0x10001, 0x10002, 0x10003, 0x10004, 0x10005, 0x10006,
+		0x10007, 0x10008, 0x10009, 0x1000A, 0x1000B, 0x1000C, 0x1000D,
+		0x1000E, 0x1000F, 0x10010, 0x10011, 0x10012, 0x10013, 0x10014,
+		0x10015, 0x10016, 0x10017, 0x10018, 0x10019, 0x1001A, 0x1001B,
+		0x1001C, 0x1001D, 0x1001E, 0x1001F, 0x10020, 0x10021, 0x10022,
+		0x10023, 0x10024, 0x10025, 0x10026,
+
+		// Black sound
+		0x11000, 0x11001, 0x11002, 0x11003, 0x11004
+	};
+
+	// Bundle 2 v5 has no verified list of types yet, only an upper bound.
+	constexpr uint32_t bundle2V5MaxType = 0x701;
+
+	// Collision-free multiplicative hash of a fixed set of keys into a table
+	// of 2^Bits slots.
+	template<int Bits>
+	struct PerfectHash
+	{
+		static constexpr size_t size = size_t(1) << Bits;
+		static constexpr uint32_t empty = 0xFFFFFFFF;
+
+		uint32_t multiplier = 0;
+		std::array<uint32_t, size> table = {};
+
+		static constexpr uint32_t slot(uint32_t key, uint32_t multiplier)
+		{
+			return (key * multiplier) >> (32 - Bits);
+		}
+
+		constexpr bool contains(uint32_t key) const
+		{
+			return key != empty && table[slot(key, multiplier)] == key;
+		}
+	};
+
+	// Searches for the first multiplier that maps every key to its own slot.
+	template<int Bits, size_t N>
+	constexpr PerfectHash<Bits> makePerfectHash(const uint32_t (&keys)[N])
+	{
+		PerfectHash<Bits> hash;
+		for (uint32_t multiplier = 0x9E3779B1; ; multiplier += 2)
+		{
+			hash.table.fill(PerfectHash<Bits>::empty);
+			bool collided = false;
+			for (size_t i = 0; i < N && !collided; ++i)
+			{
+				uint32_t& slot
+					= hash.table[PerfectHash<Bits>::slot(keys[i], multiplier)];
+				if (slot != PerfectHash<Bits>::empty)
+					collided = true;
+				slot = keys[i];
+			}
+			if (!collided)
+			{
+				hash.multiplier = multiplier;
+				return hash;
+			}
+		}
+	}
+
+	constexpr auto bundle2Hash = makePerfectHash<11>(bundle2Types);
+
+	// Returns whether the type ID exists in Bundle 1 or Bundle 2 v2/v3.
+	constexpr bool isBundle2Type(uint32_t typeId)
+	{
+		return bundle2Hash.contains(typeId);
+	}
+
+	// Returns whether the type ID may exist in Bundle 2 v5.
+	constexpr bool isBundle2V5Type(uint32_t typeId)
+	{
+		return typeId <= bundle2V5MaxType;
+	}
+
+	static_assert(isBundle2Type(0x0) && isBundle2Type(0xA010)
+		&& isBundle2Type(0x11004));
+	static_assert(!isBundle2Type(0x33) && !isBundle2Type(0xA02A)
+		&& !isBundle2Type(0x10027) && !isBundle2Type(0x11005)
+		&& !isBundle2Type(PerfectHash<11>::empty));
+}
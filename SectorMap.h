@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+
+#include <QFile>
+#include <QString>
+
+// Classification of every sector of an image by its contents, built while
+// the image is scanned for bundles.
+//
+// The defragmenter uses the map to skip candidate fragment offsets whose
+// contents can't be what it is looking for without reading them. Each
+// sector's type, and whether it contains a zlib header, are stored in 4 bits
+// in a memory-mapped file next to the journal, so the map is kept between
+// runs and shared by all threads.
+class SectorMap
+{
+public:
+	enum class Type : uint8_t
+	{
+		Unknown, // Not scanned
+		Zero,
+		BundleHeader, // Starts with a bndl or bnd2 magic
+		Text, // Printable ASCII, optionally followed by null padding
+		LowEntropy,
+		HighEntropy
+	};
+
+	// Contents expected at the start of a fragment
+	enum class Content
+	{
+		Text, // Debug data
+		Binary, // Resource entries
+		Compressed // zlib data
+	};
+
+	~SectorMap();
+
+	// Opens the map at the path for an image of the size, creating it if it
+	// does not exist or was made for a different image size or interval.
+	// Returns false if it can't be mapped.
+	bool open(const QString& path, uint64_t imageSize, int interval);
+
+	void close();
+
+	// Returns the type of the sector data.
+	static Type classify(const char* data, int size);
+
+	// Returns whether the sector data contains a zlib header (78 DA).
+	static bool containsZlibHeader(const char* data, int size);
+
+	// Sets the type of the sector at the offset. Threads may set different
+	// sectors at once.
+	void set(uint64_t offset, Type type, bool zlibHeader);
+
+	// Returns the type of the sector at the offset.
+	Type get(uint64_t offset) const;
+
+	// Returns whether a zlib header could start at the offset. This is false
+	// only if its sector was scanned and contains no header.
+	bool mayHaveZlibHeader(uint64_t offset) const;
+
+	// Returns whether a fragment with the content, of which size bytes
+	// remain, could start at the offset.
+	bool mayStartFragment(uint64_t offset, Content content, int size) const;
+
+	// As above, for a sector type that has already been looked up.
+	bool mayStartFragment(Type type, Content content, int size) const;
+
+private:
+	struct Header
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t interval;
+		uint32_t reserved;
+		uint64_t sectors;
+	};
+
+	static constexpr uchar typeMask = 0x7;
+	static constexpr uchar zlibHeaderFlag = 0x8;
+
+	// Returns the 4 bits stored for the sector at the offset.
+	uchar bits(uint64_t offset) const;
+
+	QFile file;
+	uchar* types = nullptr; // Two sectors per byte, first in the low bits
+	uint64_t sectors = 0;
+	int interval = 0;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+
+// Byte-oriented well-formedness checker for bundle debug data
+// (ResourceStringTable XML).
+//
+// Data is checked as it is fed in, without converting it to UTF-16 or
+// allocating. All state is held in the object, so a copy taken after feeding
+// the known part of the data can be resumed for each candidate continuation.
+// Checking stops at the first null byte, which ends the debug data. Element
+// names are matched by hash, and only the predefined entities are accepted.
+class XmlChecker
+{
+public:
+	// Checks size more bytes of the document. Returns false once the data is
+	// not well-formed.
+	bool feed(const char* data, int size);
+
+	// Returns whether the data checked so far is a complete document.
+	bool complete() const;
+
+	// Returns whether the data is not well-formed.
+	bool failed() const;
+
+	// Returns whether a null byte ended the data.
+	bool ended() const;
+
+	// Returns the number of bytes checked, up to and including the byte the
+	// data stopped being well-formed at, or up to the null byte ending it.
+	int offset() const;
+
+private:
+	enum class State : uint8_t
+	{
+		Content, // Text between tags
+		TagOpen, // After <
+		StartTagName,
+		InTag, // Between attributes
+		AttributeName,
+		AfterAttributeName,
+		BeforeValue,
+		Value,
+		AfterValue,
+		EmptyTagEnd, // After / in a start tag
+		EndTagName,
+		AfterEndTagName,
+		Reference, // After &
+		CharacterReference, // After &#
+		ProcessingInstruction,
+		Markup, // After <!, matching the literal
+		Comment,
+		CData,
+		Doctype,
+		Error
+	};
+
+	// Checks one byte.
+	void check(uint8_t c);
+
+	// Returns from a reference to the state it was in.
+	void endReference();
+
+	void openElement();
+	void closeElement();
+
+	static bool isSpace(uint8_t c);
+	static bool isNameStart(uint8_t c);
+	static bool isName(uint8_t c);
+
+	static constexpr int maxDepth = 64;
+
+	State state = State::Content;
+	State referenceReturn = State::Content; // State a reference is part of
+	uint8_t quote = 0; // Quote the attribute value ends with
+	bool spaced = false; // Whitespace since the last attribute
+	bool rootOpened = false;
+	bool rootClosed = false;
+	bool stopped = false; // A null byte ended the data
+	const char* literal = nullptr; // Markup literal being matched
+	int matched = 0; // Bytes of the literal or terminator matched
+	uint32_t nameHash = 0;
+	int nameLength = 0;
+	uint32_t reference = 0; // Entity name or character code
+	int referenceLength = 0;
+	bool hexReference = false;
+	int depth = 0;
+	uint32_t nameHashes[maxDepth] = {};
+	int nameLengths[maxDepth] = {};
+	int position = 0;
+};
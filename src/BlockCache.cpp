@@ -0,0 +1,207 @@
+#include "../BlockCache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#endif
+
+BlockCache::~BlockCache()
+{
+	close();
+}
+
+bool BlockCache::open(const QString& path, uint64_t budget, int queueDepth,
+	ConcurrencyController* controller)
+{
+	close();
+
+	file.setFileName(path);
+	if (!file.open(QIODevice::ReadOnly | QIODevice::ExistingOnly))
+		return false;
+
+	// Looked up once, as QFile creates it on first use
+#ifdef Q_OS_WIN
+	handle = _get_osfhandle(file.handle());
+#else
+	handle = file.handle();
+#endif
+	if (handle == -1)
+	{
+		close();
+		return false;
+	}
+
+	fileSize = file.size();
+	shardBudget = std::max<uint64_t>(budget / shardCount, blockSize);
+
+	// Reads are only worth ordering where seeks are slow
+	scheduler.start(handle, IoScheduler::isRotational(path) ? queueDepth : 0,
+		controller);
+
+	return true;
+}
+
+void BlockCache::close()
+{
+	for (Shard& shard : shards)
+	{
+		QMutexLocker locker(&shard.mutex);
+		shard.blocks.clear();
+		shard.uses.clear();
+		shard.used = 0;
+	}
+	scheduler.stop();
+	if (file.isOpen())
+		file.close();
+	handle = -1;
+	fileSize = 0;
+	hitCount = 0;
+	missCount = 0;
+}
+
+uint64_t BlockCache::size() const
+{
+	return fileSize;
+}
+
+int64_t BlockCache::read(uint64_t offset, char* data, int64_t size)
+{
+	if (handle == -1)
+		return -1;
+	if (offset >= fileSize || size <= 0)
+		return 0;
+	size = std::min<uint64_t>(size, fileSize - offset);
+
+	// Reads too large to keep would only push out everything else
+	if ((uint64_t)size > shardBudget)
+		return scheduler.read(offset, data, size);
+
+	int64_t done = 0;
+	while (done < size)
+	{
+		uint64_t position = offset + done;
+		QByteArray cached = block(position / blockSize);
+		int start = position % blockSize;
+		if (cached.size() <= start)
+			return done != 0 ? done : -1;
+
+		int64_t length = std::min<int64_t>(cached.size() - start, size - done);
+		memcpy(data + done, cached.constData() + start, length);
+		done += length;
+	}
+
+	return done;
+}
+
+int64_t BlockCache::readUncached(uint64_t offset, char* data, int64_t size)
+{
+	if (handle == -1)
+		return -1;
+	if (offset >= fileSize || size <= 0)
+		return 0;
+	size = std::min<uint64_t>(size, fileSize - offset);
+
+	return scheduler.read(offset, data, size);
+}
+
+void BlockCache::load(uint64_t offset, uint64_t size)
+{
+	if (handle == -1 || offset >= fileSize)
+		return;
+	size = std::min(size, fileSize - offset);
+
+	for (uint64_t index = offset / blockSize;
+		index <= (offset + size - 1) / blockSize; ++index)
+		block(index, false);
+}
+
+bool BlockCache::isScheduled() const
+{
+	return scheduler.isScheduled();
+}
+
+const QFile& BlockCache::source() const
+{
+	return file;
+}
+
+uint64_t BlockCache::hits() const
+{
+	return hitCount;
+}
+
+uint64_t BlockCache::misses() const
+{
+	return missCount;
+}
+
+QByteArray BlockCache::block(uint64_t index, bool counted)
+{
+	Shard& shard = shards[index % shardCount];
+
+	shard.mutex.lock();
+	auto found = shard.blocks.find(index);
+	if (found != shard.blocks.end())
+	{
+		shard.uses.splice(shard.uses.begin(), shard.uses, found->second.use);
+		QByteArray data = found->second.data;
+		shard.mutex.unlock();
+		if (counted)
+			++hitCount;
+		return data;
+	}
+	shard.mutex.unlock();
+	if (counted)
+		++missCount;
+
+	// Read without holding the lock so other blocks in the shard can be used
+	// meanwhile
+	uint64_t offset = index * blockSize;
+	QByteArray data(std::min<uint64_t>(blockSize, fileSize - offset),
+		Qt::Uninitialized);
+	int64_t read = scheduler.read(offset, data.data(), data.size());
+	if (read <= 0)
+		return {};
+	data.truncate(read);
+
+	QMutexLocker locker(&shard.mutex);
+	if (shard.blocks.count(index))
+		return shard.blocks[index].data; // Read by another thread meanwhile
+	shard.uses.push_front(index);
+	shard.blocks[index] = { data, shard.uses.begin() };
+	shard.used += data.size();
+
+	// Drop the least recently used blocks until back under budget
+	while (shard.used > shardBudget && shard.uses.size() > 1)
+	{
+		auto evicted = shard.blocks.find(shard.uses.back());
+		shard.used -= evicted->second.data.size();
+		shard.blocks.erase(evicted);
+		shard.uses.pop_back();
+	}
+
+	return data;
+}
+
+CachedImage::CachedImage(BlockCache& cache)
+	: cache(cache)
+{
+	open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+}
+
+qint64 CachedImage::size() const
+{
+	return cache.size();
+}
+
+qint64 CachedImage::readData(char* data, qint64 maxSize)
+{
+	return cache.read(pos(), data, maxSize);
+}
+
+qint64 CachedImage::writeData(const char* data, qint64 maxSize)
+{
+	return -1; // Read-only
+}
@@ -21,15 +21,11 @@
 //     VEHICLES/VEH_XUSRCB1_AT.BIN|XUSRCB1_AttribSys,XUSRCB1DeformationModel
 
 #include "../BundleRecovery.h"
+#include "../ResourceTypes.h"
 
 #include <QtZlib/zlib.h>
 
 #include <QFileDialog>
-#include <QJsonArray>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonValue>
-#include <QStandardPaths>
 
 void BundleRecovery::selectInputFile()
 {
@@ -77,6 +73,9 @@ void BundleRecovery::recover()
 	endOffset = ui.doubleSpinBoxEnd->value();
 	interval = ui.doubleSpinBoxInterval->value();
 	searchLength = ui.doubleSpinBoxLength->value();
+	beamWidth = ui.spinBoxBeamWidth->value();
+	defragBudget = ui.spinBoxBudget->value();
+	queueDepth = ui.spinBoxQueueDepth->value();
 
 	log("Input file: " + input);
 	log("Start offset: 0x" + QString::number(startOffset, 16));
@@ -87,6 +86,10 @@ void BundleRecovery::recover()
 	if (ui.checkBoxDefrag->isChecked())
 	{
 		log("Fragment search length: 0x" + QString::number(searchLength, 16));
+		log("Fragment beam width: " + QString::number(beamWidth));
+		if (defragBudget != 0)
+			log("Time budget per bundle: " + QString::number(defragBudget)
+				+ " seconds");
 		if (ui.checkBoxSearchAll->isChecked())
 			log("Search whole image: true");
 		else
@@ -116,139 +119,55 @@ void BundleRecovery::recover()
 	if (imgSize < endOffset)
 		endOffset = in.size();
 
+	// Threads after the Finder share one cache of the image, which is read
+	// ahead of them
+	prefetcher.stop();
+	if (!imageCache.open(input, imageCacheSize, queueDepth, &ioThreads))
+	{
+		log("Failed to open input file");
+		return;
+	}
+	prefetcher.start(imageCache);
+	if (imageCache.isScheduled())
+		log("Input is on a rotational disk, reads are served in order with "
+			"queue depth " + QString::number(queueDepth));
+
+	// Resume from where a previous run on the same image left off
+	loadCheckpoint();
+
 	// Storage for the information that recovery requires
 	std::vector<FileInfo> fileInfo; // Bundle/fragment positions and sizes
 	std::vector<Bundle> bundleList; // Bundle headers
-	std::vector<QString> debugDataList; // Bundle debug data
+	std::vector<QByteArray> debugDataList; // Bundle debug data
 	std::vector<std::vector<ResourceEntry>> resourceLists; // Resource entries
-	std::vector<std::vector<std::vector<ImportEntry>>> importLists; // Resource imports
 	std::vector<CorruptionType> isBundleCorrupt; // Corruption states
-
-	// JSON file for writing/reading information to/from
-	QFile jsonFile(QStandardPaths::standardLocations(
-		QStandardPaths::AppDataLocation)[0] + "/../burninrubber0/BundleRecovery.json");
-	QJsonDocument jsonDoc;
-	jsonFile.open(QFile::ReadWrite);
-	//if (jsonFile.isOpen())
-	//	jsonDoc = QJsonDocument::fromJson(jsonFile.readAll());
-	QJsonArray jsonArray; // Top-level JSON array - bundles
+	std::vector<BundleBuffer> bufferList; // Data read by validation
 
 	// Get thread count
-	int numThreads = QThread::idealThreadCount();
+	int numThreads = executor.size();
 	log("Detected " + QString::number(numThreads) + " logical threads");
 
-	// Find bundles
-	log("Finding bundles");
-	for (int i = 0; i < numThreads; ++i)
-	{
-		// Split the image evenly between threads
-		uint64_t s = (imgSize / (numThreads)) * i;
-		uint64_t e = (imgSize / (numThreads)) * (i + 1);
-		if (i == numThreads - 1)
-			e = imgSize; // End of image
-		threads.push_back(QThread::create(
-			[this, &fileInfo, &bundleList, s, e, i]
-			{
-				findBundles(fileInfo, bundleList, s, e, i);
-			}));
-		connect(threads[i], &QThread::finished, threads[i],
-			&QThread::deleteLater);
-		threads[i]->start();
-	}
-	for (int i = 0; i < threads.size(); ++i)
-		threads[i]->wait();
-	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
-	{
-		clearThreads();
-		return;
-	}
-	clearThreads();
-	log("Found " + QString::number(bundleList.size()) + " bundles");
-
-	// Sort bundles and populate the other vectors with the correct amount
-	// of elements
-	sortBundles(fileInfo, bundleList);
-	for (int i = 0; i < fileInfo.size(); ++i)
-	{
-		debugDataList.push_back({});
-		resourceLists.push_back({});
-		importLists.push_back({});
-		isBundleCorrupt.push_back({});
-	}
-	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
-		return;
-
-	// Write found file info to JSON
-	for (int i = 0; i < fileInfo.size(); ++i)
+	// Rename using provided names if option selected
+	if (ui.checkBoxExtract->isChecked() && ui.checkBoxRename->isChecked())
 	{
-		QJsonArray potentialsArray; // One potential until defrag
-		QJsonObject fileInfoObject; // Only offset for now, size found later
-		fileInfoObject.insert("position", (qint64)fileInfo[i].pos[0]);
-		fileInfoObject.insert("size", 0); // No bundle ever has a 0 size
-		potentialsArray.append(fileInfoObject);
-		jsonArray.append(potentialsArray);
+		log("TODO: Renamer");
 	}
-	jsonDoc.setArray(jsonArray);
-	jsonFile.write(jsonDoc.toJson());
-	jsonFile.close(); // Temp - move down after finishing
 
-	// Read data into the vectors
-	log("Reading bundle info");
-	for (int i = 0; i < numThreads; ++i)
-	{
-		// Each thread works on a set of bundles
-		int s = bundleList.size() / (numThreads) * i;
-		int e = bundleList.size() / (numThreads) * (i + 1);
-		if (i == numThreads - 1)
-			e = bundleList.size();
-		threads.push_back(QThread::create(
-			[this, &fileInfo, &bundleList, &debugDataList, &resourceLists,
-			s, e, i]
-			{
-				readBundles(fileInfo, bundleList, debugDataList, resourceLists,
-					s, e, i);
-			}));
-		connect(threads[i], &QThread::finished, threads[i],
-			&QThread::deleteLater);
-		threads[i]->start();
-	}
-	for (int i = 0; i < threads.size(); ++i)
-		threads[i]->wait();
+	// Find bundles, reading, validating and extracting each as soon as it is
+	// found
+	log("Finding bundles");
+	resetConcurrency(numThreads);
+	std::vector<BundleBatch> batches(
+		(imgSize + scanChunkSize - 1) / scanChunkSize);
+	streamBundles(batches, imgSize);
+	saveCheckpoint();
 	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
-	{
-		clearThreads();
 		return;
-	}
-	clearThreads();
+	logConcurrency("Finding and validating");
+	mergeBatches(batches, fileInfo, bundleList, debugDataList, resourceLists,
+		isBundleCorrupt, bufferList);
+	log("Found " + QString::number(bundleList.size()) + " bundles");
 
-	// Validate bundle integrity
-	log("Validating bundles");
-	for (int i = 0; i < numThreads; ++i)
-	{
-		// Each thread works on a set of bundles
-		int s = bundleList.size() / (numThreads) * i;
-		int e = bundleList.size() / (numThreads) * (i + 1);
-		if (i == numThreads - 1)
-			e = bundleList.size();
-		threads.push_back(QThread::create(
-			[this, &fileInfo, &bundleList, &debugDataList, &resourceLists,
-			&importLists, &isBundleCorrupt, s, e, i]
-			{
-				validateBundles(fileInfo, bundleList, debugDataList,
-					resourceLists, importLists, isBundleCorrupt, s, e, i);
-			}));
-		connect(threads[i], &QThread::finished, threads[i],
-			&QThread::deleteLater);
-		threads[i]->start();
-	}
-	for (int i = 0; i < threads.size(); ++i)
-		threads[i]->wait();
-	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
-	{
-		clearThreads();
-		return;
-	}
-	clearThreads();
 	int numCorrupt = 0;
 	for (int i = 0; i < isBundleCorrupt.size(); ++i)
 		if (isBundleCorrupt[i] != CorruptionType::Intact
@@ -260,32 +179,59 @@ void BundleRecovery::recover()
 	if (ui.checkBoxDefrag->isChecked())
 	{
 		log("Defragmenting bundles");
-		for (int i = 0; i < numThreads; ++i)
-		{
-			// Each thread works on a set of bundles
-			int s = bundleList.size() / (numThreads) * i;
-			int e = bundleList.size() / (numThreads) * (i + 1);
-			if (i == numThreads - 1)
-				e = bundleList.size();
-			threads.push_back(QThread::create(
-				[this, &fileInfo, bundleList, &debugDataList, &resourceLists,
-				&importLists, &isBundleCorrupt, s, e, i]
-				{
-					defragBundles(fileInfo, bundleList, debugDataList,
-						resourceLists, importLists, isBundleCorrupt, s, e, i);
-				}));
-			connect(threads[i], &QThread::finished, threads[i],
-				&QThread::deleteLater);
-			threads[i]->start();
-		}
-		for (int i = 0; i < threads.size(); ++i)
-			threads[i]->wait();
+		resetConcurrency(numThreads);
+		zlibQueries.clear();
+		zlibSearches.clear();
+		gapModel.clear();
+		continuationMemo.reset(continuationMemoSize);
+
+		// Space used by intact bundles can't hold another bundle's fragments.
+		// Uncompressed bundles aren't claimed, since their data is unchecked.
+		claimedSectors.reset(imgSize, interval);
+		for (int i = 0; i < fileInfo.size(); ++i)
+			if (isBundleCorrupt[i] == CorruptionType::Intact)
+				claimFragments(fileInfo[i], fileInfo[i].sz.size());
+		log(QString::number(claimedSectors.count() * interval / 0x100000)
+			+ " MiB used by intact bundles");
+
+		// Easy bundles are done first, and hard ones after them
+		defragQueue(fileInfo, bundleList, debugDataList, resourceLists,
+			isBundleCorrupt, bufferList, getDefragQueue(fileInfo, bundleList,
+			resourceLists, isBundleCorrupt), defragBudget);
+		saveCheckpoint();
 		if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
-		{
-			clearThreads();
 			return;
+
+		// Search the whole image for fragments that weren't found nearby,
+		// then continue defragmenting the bundles they were found for. This
+		// repeats until no bundle needs another search.
+		while (!zlibQueries.empty())
+		{
+			std::vector<ZlibQuery> queries;
+			queries.swap(zlibQueries);
+			searchZlibQueries(queries);
+			if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+				return;
+			std::vector<int> pending = applyZlibQueries(queries, fileInfo,
+				bundleList, resourceLists, isBundleCorrupt, bufferList);
+			saveCheckpoint();
+
+			defragQueue(fileInfo, bundleList, debugDataList, resourceLists,
+				isBundleCorrupt, bufferList, pending, defragBudget);
+			saveCheckpoint();
+			if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+				return;
 		}
-		clearThreads();
+
+		if (continuationMemo.lookups() != 0)
+			log("Fragment candidate cache: "
+				+ QString::number(continuationMemo.hits()) + " of "
+				+ QString::number(continuationMemo.lookups()) + " lookups hit ("
+				+ QString::number(100.0 * continuationMemo.hits()
+					/ continuationMemo.lookups(), 'f', 1) + "%)");
+
+		logConcurrency("Defragmenting");
+
 		int newNumCorrupt = 0;
 		for (int i = 0; i < isBundleCorrupt.size(); ++i)
 			if (isBundleCorrupt[i] != CorruptionType::Intact
@@ -295,42 +241,40 @@ void BundleRecovery::recover()
 			+ QString::number(numCorrupt) + " bundles defragmented");
 	}
 
-	// Extract bundles from image
-	if (ui.checkBoxExtract->isChecked())
+	// Extract the bundles left corrupt. The rest were extracted once they
+	// were found intact or defragmented.
+	if (ui.checkBoxExtract->isChecked() && ui.checkBoxDefrag->isChecked())
 	{
-		// Rename using provided names if option selected
-		if (ui.checkBoxRename->isChecked())
-		{
-			log("TODO: Renamer");
-		}
-		
-		log("Extracting bundles");
-		for (int i = 0; i < numThreads; ++i)
-		{
-			// Each thread works on a set of bundles
-			int s = bundleList.size() / (numThreads) * i;
-			int e = bundleList.size() / (numThreads) * (i + 1);
-			if (i == numThreads - 1)
-				e = bundleList.size();
-			threads.push_back(QThread::create(
-				[this, &in, fileInfo, bundleList, isBundleCorrupt, s, e, i]
-				{
-					extractBundles(fileInfo, isBundleCorrupt, s, e, i);
-				}));
-			connect(threads[i], &QThread::finished, threads[i],
-				&QThread::deleteLater);
-			threads[i]->start();
-		}
-		for (int i = 0; i < threads.size(); ++i)
-			threads[i]->wait();
+		std::vector<int> remaining;
+		for (int i = 0; i < isBundleCorrupt.size(); ++i)
+			if (isBundleCorrupt[i] != CorruptionType::Intact
+				&& isBundleCorrupt[i] != CorruptionType::Uncompressed)
+				remaining.push_back(i);
+
+		log("Extracting corrupt bundles");
+		resetConcurrency(numThreads);
+		executor.run(remaining.size(),
+			[this, &fileInfo, &isBundleCorrupt, &remaining](int n, int thread)
+			{
+				if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+					return;
+				extractBundles(fileInfo, isBundleCorrupt, remaining[n],
+					remaining[n] + 1, thread);
+			});
+		saveCheckpoint();
 		if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
-		{
-			clearThreads();
 			return;
-		}
-		clearThreads();
-		log("Finished extracting");
+		logConcurrency("Extracting");
 	}
+	if (ui.checkBoxExtract->isChecked())
+		log("Finished extracting");
+
+	if (imageCache.hits() + imageCache.misses() != 0)
+		log("Image cache: " + QString::number(imageCache.hits()) + " of "
+			+ QString::number(imageCache.hits() + imageCache.misses())
+			+ " blocks read hit ("
+			+ QString::number(100.0 * imageCache.hits()
+				/ (imageCache.hits() + imageCache.misses()), 'f', 1) + "%)");
 
 	log("Done");
 }
@@ -340,15 +284,29 @@ void BundleRecovery::stopRecovery()
 	log("Recovery cancelled.");
 }
 
-void BundleRecovery::clearThreads()
+void BundleRecovery::resetConcurrency(int numThreads)
 {
-	for (int i = 0; i < threads.size(); ++i)
-	{
-		threads[i]->quit();
-		threads[i]->wait();
-		delete threads[i];
-	}
-	threads.clear();
+	// Disks which have to seek do best with one thread, so start from there
+	ioThreads.reset(imageCache.isScheduled() ? 1 : numThreads, numThreads);
+	cpuThreads.reset(numThreads, numThreads);
+	stageStart = QDateTime::currentMSecsSinceEpoch();
+}
+
+void BundleRecovery::logConcurrency(const QString& stage)
+{
+	int64_t timeTaken = QDateTime::currentMSecsSinceEpoch() - stageStart;
+	QString message = stage + " took " + QString::number(timeTaken / 1000)
+		+ " seconds, " + QString::number(ioThreads.limit())
+		+ " threads reading ("
+		+ QString::number(ioThreads.throughput() / 0x100000, 'f', 1)
+		+ " MiB/s, " + QString::number(ioThreads.latency(), 'f', 2)
+		+ " ms per read)";
+	if (cpuThreads.throughput() != 0)
+		message += ", " + QString::number(cpuThreads.limit())
+			+ " threads working on bundles ("
+			+ QString::number(cpuThreads.throughput() / 0x100000, 'f', 1)
+			+ " MiB/s)";
+	log(message);
 }
 
 int BundleRecovery::nearestMultiple(int val, int mult)
@@ -442,6 +400,15 @@ uint16_t BundleRecovery::GetAlignmentFromSAA(uint32_t data)
 	return (1 << ((data & 0xF0000000) >> 28));
 }
 
+bool BundleRecovery::IsKnownResourceType(const Bundle& bundle,
+	uint32_t typeId)
+{
+	if (!strncmp(bundle.magic, "bnd2", 4) && bundle.version == 5)
+		return ResourceTypes::isBundle2V5Type(typeId);
+
+	return ResourceTypes::isBundle2Type(typeId);
+}
+
 libdeflate_result BundleRecovery::GetLibdeflateResult(char* resource, int cmp,
 	int ucmp, libdeflate_decompressor* dc)
 {
@@ -547,6 +514,10 @@ void BundleRecovery::connectUi()
 		{
 			ui.labelLength->setEnabled(ui.checkBoxDefrag->isChecked());
 			ui.doubleSpinBoxLength->setEnabled(ui.checkBoxDefrag->isChecked());
+			ui.labelBeamWidth->setEnabled(ui.checkBoxDefrag->isChecked());
+			ui.spinBoxBeamWidth->setEnabled(ui.checkBoxDefrag->isChecked());
+			ui.labelBudget->setEnabled(ui.checkBoxDefrag->isChecked());
+			ui.spinBoxBudget->setEnabled(ui.checkBoxDefrag->isChecked());
 			ui.checkBoxSearchAll->setEnabled(ui.checkBoxDefrag->isChecked());
 		});
 	connect(ui.checkBoxExtract, &QCheckBox::stateChanged, this,
@@ -610,6 +581,7 @@ BundleRecovery::BundleRecovery(QWidget* parent)
 	setWindowFlags(Qt::Dialog | Qt::MSWindowsFixedSizeDialogHint);
 	setAttribute(Qt::WA_DeleteOnClose);
 	connectUi();
+	executor.start(QThread::idealThreadCount());
 
 	connect(this, &BundleRecovery::log, ui.plainTextEditLog,
 		&QPlainTextEdit::appendPlainText);
@@ -617,5 +589,5 @@ BundleRecovery::BundleRecovery(QWidget* parent)
 
 BundleRecovery::~BundleRecovery()
 {
-	clearThreads();
+	executor.stop();
 }
@@ -0,0 +1,144 @@
+#include "../CandidateOrder.h"
+
+#include <algorithm>
+
+void GapModel::record(int64_t gap)
+{
+	QMutexLocker locker(&mutex);
+	++counts[gap];
+}
+
+void GapModel::clear()
+{
+	QMutexLocker locker(&mutex);
+	counts.clear();
+}
+
+std::vector<int64_t> GapModel::likely(int count)
+{
+	std::vector<std::pair<int, int64_t>> sorted;
+	mutex.lock();
+	for (const auto& gap : counts)
+		sorted.push_back({ gap.second, gap.first });
+	mutex.unlock();
+
+	// Most common first, nearest first among equally common gaps
+	std::sort(sorted.begin(), sorted.end(),
+		[](const auto& a, const auto& b)
+		{
+			if (a.first != b.first)
+				return a.first > b.first;
+			return std::abs(a.second) < std::abs(b.second);
+		});
+
+	std::vector<int64_t> gaps;
+	for (int i = 0; i < sorted.size() && i < count; ++i)
+		gaps.push_back(sorted[i].second);
+
+	return gaps;
+}
+
+CandidateOrder::CandidateOrder(uint64_t start, uint64_t end,
+	uint64_t backStart, uint64_t backEnd, int interval,
+	const std::vector<int64_t>& likelyGaps)
+	: start(start), backStart(backStart), interval(interval)
+{
+	forwardCount = end > start ? (end - start + interval - 1) / interval : 0;
+	backwardCount = backStart > backEnd
+		? (backStart - backEnd) / interval : 0;
+
+	// Forward candidate k is k intervals from start, and backward candidate m
+	// is start - backStart + (m + 1) intervals from it. So the forward ones up
+	// to the first backward one's distance go first, then the two alternate.
+	uint64_t behind = start > backStart ? start - backStart : 0;
+	leadCount = std::min(forwardCount, behind / interval + 2);
+	pairCount = std::min(forwardCount - leadCount, backwardCount);
+
+	// Only gaps landing in one of the windows are tried early
+	for (int64_t gap : likelyGaps)
+	{
+		uint64_t offset = start + gap;
+		if ((offset >= start && offset < end)
+			|| (offset < backStart && offset >= backEnd))
+		{
+			likely.push_back(offset);
+			uint64_t rank;
+			if (windowRank(offset, rank))
+				skipped.push_back(rank);
+		}
+	}
+	std::sort(skipped.begin(), skipped.end());
+}
+
+uint64_t CandidateOrder::size() const
+{
+	return likely.size() + forwardCount + backwardCount - skipped.size();
+}
+
+uint64_t CandidateOrder::at(uint64_t rank) const
+{
+	if (rank < likely.size())
+		return likely[rank];
+	rank -= likely.size();
+
+	// Step over the likely offsets already tried
+	for (uint64_t skip : skipped)
+	{
+		if (skip > rank)
+			break;
+		++rank;
+	}
+
+	return windowAt(rank);
+}
+
+uint64_t CandidateOrder::windowAt(uint64_t rank) const
+{
+	if (rank < leadCount)
+		return start + rank * interval;
+	rank -= leadCount;
+
+	// Alternate backward and forward while both windows have candidates left,
+	// then continue with whichever is larger
+	if (rank < pairCount * 2)
+	{
+		if (rank % 2 == 0)
+			return backStart - (rank / 2 + 1) * interval;
+		return start + (leadCount + rank / 2) * interval;
+	}
+
+	rank -= pairCount;
+	if (forwardCount - leadCount > backwardCount)
+		return start + (leadCount + rank) * interval;
+	return backStart - (rank + 1) * interval;
+}
+
+bool CandidateOrder::windowRank(uint64_t offset, uint64_t& rank) const
+{
+	if (offset >= start)
+	{
+		if ((offset - start) % interval != 0)
+			return false;
+		uint64_t k = (offset - start) / interval;
+		if (k >= forwardCount)
+			return false;
+		if (k < leadCount)
+			rank = k;
+		else if (k - leadCount < pairCount)
+			rank = leadCount + (k - leadCount) * 2 + 1;
+		else
+			rank = pairCount + k;
+		return true;
+	}
+
+	if (offset >= backStart || (backStart - offset) % interval != 0)
+		return false;
+	uint64_t m = (backStart - offset) / interval - 1;
+	if (m >= backwardCount)
+		return false;
+	if (m < pairCount)
+		rank = leadCount + m * 2;
+	else
+		rank = leadCount + pairCount + m;
+	return true;
+}
@@ -0,0 +1,51 @@
+#include "../ClaimedSectors.h"
+
+#include <algorithm>
+#include <bit>
+
+void ClaimedSectors::reset(uint64_t imageSize, int interval)
+{
+	this->interval = interval;
+	sectors = (imageSize + interval - 1) / interval;
+	wordCount = (sectors + 63) / 64;
+	words.reset(new std::atomic<uint64_t>[wordCount]);
+	for (uint64_t i = 0; i < wordCount; ++i)
+		words[i].store(0, std::memory_order_relaxed);
+}
+
+void ClaimedSectors::claim(uint64_t pos, uint64_t size)
+{
+	if (size == 0 || !words)
+		return;
+
+	uint64_t first = pos / interval;
+	uint64_t last = std::min((pos + size - 1) / interval, sectors - 1);
+	for (uint64_t sector = first; sector <= last;)
+	{
+		// Set whole words at a time where possible
+		uint64_t bit = sector % 64;
+		uint64_t bits = std::min<uint64_t>(64 - bit, last - sector + 1);
+		uint64_t mask = bits == 64 ? ~0ull : ((1ull << bits) - 1) << bit;
+		words[sector / 64].fetch_or(mask, std::memory_order_relaxed);
+		sector += bits;
+	}
+}
+
+bool ClaimedSectors::isClaimed(uint64_t offset) const
+{
+	uint64_t sector = offset / interval;
+	if (!words || sector >= sectors)
+		return false;
+
+	return words[sector / 64].load(std::memory_order_relaxed)
+		& (1ull << (sector % 64));
+}
+
+uint64_t ClaimedSectors::count() const
+{
+	uint64_t count = 0;
+	for (uint64_t i = 0; i < wordCount; ++i)
+		count += std::popcount(words[i].load(std::memory_order_relaxed));
+
+	return count;
+}
@@ -0,0 +1,138 @@
+#include "../ConcurrencyController.h"
+
+#include <algorithm>
+#include <chrono>
+
+// Fraction of the last period's throughput a step may lose before it is
+// taken back, so noise doesn't turn the limit around
+static constexpr double throughputTolerance = 0.05;
+
+ConcurrencyController::Permit::Permit(ConcurrencyController& controller,
+	uint64_t work)
+	: controller(controller), work(work)
+{
+	acquired = controller.acquire();
+}
+
+ConcurrencyController::Permit::~Permit()
+{
+	controller.release(acquired, work);
+}
+
+void ConcurrencyController::reset(int initial, int maximum)
+{
+	QMutexLocker locker(&mutex);
+	this->maximum = std::max(maximum, 1);
+	current = std::clamp(initial, 1, this->maximum);
+	direction = 1;
+	started = now();
+	periodStart = started;
+	periodWork = 0;
+	lastThroughput = 0;
+	totalWork = 0;
+	permits = 0;
+	held = 0;
+	permitFreed.wakeAll();
+}
+
+int64_t ConcurrencyController::acquire()
+{
+	QMutexLocker locker(&mutex);
+	while (active >= current)
+		permitFreed.wait(&mutex);
+	++active;
+
+	return now();
+}
+
+bool ConcurrencyController::tryAcquire(int64_t& acquired)
+{
+	QMutexLocker locker(&mutex);
+	if (active >= current)
+		return false;
+	++active;
+	acquired = now();
+
+	return true;
+}
+
+void ConcurrencyController::release(int64_t acquired, uint64_t work)
+{
+	int64_t time = now();
+
+	QMutexLocker locker(&mutex);
+	--active;
+	count(acquired, time, work);
+	permitFreed.wakeAll();
+}
+
+void ConcurrencyController::release()
+{
+	QMutexLocker locker(&mutex);
+	--active;
+	permitFreed.wakeAll();
+}
+
+void ConcurrencyController::record(int64_t started, uint64_t work)
+{
+	int64_t time = now();
+
+	QMutexLocker locker(&mutex);
+	count(started, time, work);
+}
+
+int ConcurrencyController::limit()
+{
+	QMutexLocker locker(&mutex);
+	return current;
+}
+
+double ConcurrencyController::throughput()
+{
+	QMutexLocker locker(&mutex);
+	int64_t elapsed = now() - started;
+	return elapsed > 0 ? totalWork * 1000000.0 / elapsed : 0;
+}
+
+double ConcurrencyController::latency()
+{
+	QMutexLocker locker(&mutex);
+	return permits != 0 ? held / 1000.0 / permits : 0;
+}
+
+int64_t ConcurrencyController::now()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ConcurrencyController::count(int64_t started, int64_t time,
+	uint64_t work)
+{
+	periodWork += work;
+	totalWork += work;
+	++permits;
+	held += time - started;
+	adjust(time);
+}
+
+void ConcurrencyController::adjust(int64_t time)
+{
+	int64_t elapsed = time - periodStart;
+	if (elapsed < period * 1000)
+		return;
+
+	// Turn back if the last step made things worse
+	double throughput = periodWork * 1000000.0 / elapsed;
+	if (throughput < lastThroughput * (1 - throughputTolerance))
+		direction = -direction;
+	lastThroughput = throughput;
+
+	// Stepping past either end turns back as well
+	if (current + direction < 1 || current + direction > maximum)
+		direction = -direction;
+	current = std::clamp(current + direction, 1, maximum);
+
+	periodStart = time;
+	periodWork = 0;
+}
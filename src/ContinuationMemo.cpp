@@ -0,0 +1,81 @@
+#include "../ContinuationMemo.h"
+
+#include <cstring>
+
+// The lowest bit of a slot holds the result, the rest the key
+static constexpr uint64_t resultBit = 1;
+
+void ContinuationMemo::reset(uint64_t capacity)
+{
+	entries.reset(new std::atomic<uint64_t>[capacity]);
+	for (uint64_t i = 0; i < capacity; ++i)
+		entries[i].store(0, std::memory_order_relaxed);
+	mask = capacity - 1;
+	lookupCount = 0;
+	hitCount = 0;
+}
+
+uint64_t ContinuationMemo::key(const char* data, int size, uint64_t state)
+{
+	// Multiply-xorshift over 8 bytes at a time. The data isn't adversarial,
+	// so this only needs to spread well and be fast next to inflating it.
+	constexpr uint64_t multiplier = 0x9E3779B97F4A7C15;
+	uint64_t hash = (state ^ size) * multiplier;
+	int i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		hash = (hash ^ word) * multiplier;
+		hash ^= hash >> 32;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, data + i, size - i);
+	hash = (hash ^ tail) * multiplier;
+	hash ^= hash >> 29;
+	hash *= 0xBF58476D1CE4E5B9;
+	hash ^= hash >> 32;
+
+	// Zero marks an empty slot
+	hash &= ~resultBit;
+	return hash ? hash : resultBit << 1;
+}
+
+bool ContinuationMemo::find(uint64_t key, bool& result) const
+{
+	if (!entries)
+		return false;
+
+	uint64_t slot = entries[(key >> 1) & mask].load(
+		std::memory_order_relaxed);
+	if ((slot & ~resultBit) != key)
+		return false;
+
+	result = slot & resultBit;
+	return true;
+}
+
+void ContinuationMemo::insert(uint64_t key, bool result)
+{
+	if (!entries)
+		return;
+
+	entries[(key >> 1) & mask].store(key | (result ? resultBit : 0),
+		std::memory_order_relaxed);
+}
+
+void ContinuationMemo::count(uint64_t lookups, uint64_t hits)
+{
+	lookupCount += lookups;
+	hitCount += hits;
+}
+
+uint64_t ContinuationMemo::lookups() const
+{
+	return lookupCount;
+}
+
+uint64_t ContinuationMemo::hits() const
+{
+	return hitCount;
+}
@@ -1,104 +1,306 @@
 #include "../BundleRecovery.h"
+#include "../XmlChecker.h"
 
-#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <memory>
 //#include <sstream>
 
 #include <binaryio/util.hpp>
 
 #include <QDateTime>
 
-void BundleRecovery::defragBundles(std::vector<FileInfo>& info,
-	const std::vector<Bundle>& bundles, std::vector<QString>& debugData,
+void BundleRecovery::defragQueue(std::vector<FileInfo>& info,
+	const std::vector<Bundle>& bundles, std::vector<QByteArray>& debugData,
 	std::vector<std::vector<ResourceEntry>>& resources,
-	const std::vector<std::vector<std::vector<ImportEntry>>>& imports,
-	std::vector<CorruptionType>& corrupt, int start, int end, int threadId)
+	std::vector<CorruptionType>& corrupt, std::vector<BundleBuffer>& buffers,
+	const std::vector<int>& queue, int budget)
 {
-	log("Thread " + QString::number(threadId)
-		+ " delegated bundles " + QString::number(start)
-		+ " to " + QString::number(end - 1));
-	uint64_t dateTimePre = QDateTime::currentSecsSinceEpoch();
+	std::vector<int> overBudget;
+	QMutex overBudgetMutex;
 
-	QFile image(input);
-	image.open(QIODevice::ReadOnly);
+	// Bundles are taken in queue order, so the cheapest finish first
+	executor.run(queue.size(),
+		[this, &info, &bundles, &debugData, &resources, &corrupt, &buffers,
+		&queue, budget, &overBudget, &overBudgetMutex](int n, int thread)
+		{
+			if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+				return;
+
+			int i = queue[n];
+			{
+				ConcurrencyController::Permit permit(cpuThreads,
+					std::max(GetBundleSize(bundles[i], resources[i]), 0));
+				CachedImage image(imageCache);
+				int64_t deadline = budget == 0 ? 0
+					: QDateTime::currentMSecsSinceEpoch() + budget * 1000ll;
+				if (!defragBundle(image, info, bundles, debugData, resources,
+					corrupt, buffers, i, deadline, thread))
+				{
+					log("T" + QString::number(thread) + " Bundle at 0x"
+						+ QString::number(info[i].pos[0], 16).toUpper()
+						+ ": ran out of time, deferring");
+					overBudgetMutex.lock();
+					overBudget.push_back(i);
+					overBudgetMutex.unlock();
+					return;
+				}
+			}
+
+			// Bundles still corrupt are extracted once every search is done
+			if (ui.checkBoxExtract->isChecked()
+				&& (corrupt[i] == CorruptionType::Intact
+				|| corrupt[i] == CorruptionType::Uncompressed))
+				extractBundles(info, corrupt, i, i + 1, thread);
+		});
 
-	for (int i = start; i < end; ++i)
+	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+		return;
+
+	// Bundles that ran out of time go last, once every easier one is done
+	if (!overBudget.empty())
+	{
+		log(QString::number(overBudget.size())
+			+ " bundles ran out of time, resuming without a limit");
+		std::sort(overBudget.begin(), overBudget.end(),
+			[&queue](int a, int b)
+			{
+				return std::find(queue.begin(), queue.end(), a)
+					< std::find(queue.begin(), queue.end(), b);
+			});
+		defragQueue(info, bundles, debugData, resources, corrupt, buffers,
+			overBudget, 0);
+	}
+}
+
+std::vector<int> BundleRecovery::getDefragQueue(
+	const std::vector<FileInfo>& info, const std::vector<Bundle>& bundles,
+	const std::vector<std::vector<ResourceEntry>>& resources,
+	const std::vector<CorruptionType>& corrupt)
+{
+	// Estimated cost of each corrupt bundle. The less data is missing, the
+	// fewer fragments there are to find and the more likely all of them are
+	// found. Bundles whose surroundings can't hold the missing data cost more,
+	// since they will most likely fail. Bundles with a result from a previous
+	// run cost nothing.
+	std::vector<std::pair<int64_t, int>> costs;
+	for (int i = 0; i < info.size(); ++i)
 	{
-		// Skip intact bundles
 		if (corrupt[i] == CorruptionType::Intact
 			|| corrupt[i] == CorruptionType::Uncompressed)
 			continue;
 
-		//log("Defragging bundle at 0x"
-		//	+ QString::number(info[i].pos[0], 16).toUpper());
+		int64_t index;
+		int64_t cost = 0;
+		if (!journal.find(info[i].pos[0], Journal::RecordType::Defragged,
+			index))
+		{
+			cost = GetBundleSize(bundles[i], resources[i]);
+			for (int size : info[i].sz)
+				cost -= size;
+			cost = std::max<int64_t>(cost, 0);
+			cost = cost * 100 / getDefragLikelihood(info[i], corrupt[i], cost);
+		}
+		costs.push_back({ cost, i });
+	}
+	std::sort(costs.begin(), costs.end());
+
+	std::vector<int> queue;
+	for (const auto& cost : costs)
+		queue.push_back(cost.second);
 
-		// Hold potential fragment info here
-		// TODO: Switch to using this vector instead of info[i] in zlib defrag
-		std::vector<FileInfo> potentials = { info[i] };
+	return queue;
+}
 
-		int prevResourceIndex = -1;
-		int prevChunkIndex = -1;
-		// Find valid bundle fragments
-		while (corrupt[i] != CorruptionType::Intact
-			&& corrupt[i] != CorruptionType::Uncompressed)
-		{
-			bool breakLoop = false;
-			bool searchedAll = false;
+int BundleRecovery::getDefragLikelihood(const FileInfo& info,
+	CorruptionType corrupt, int64_t missing)
+{
+	SectorMap::Content content;
+	switch (corrupt)
+	{
+	case CorruptionType::DebugData:
+		content = SectorMap::Content::Text;
+		break;
+	case CorruptionType::ResourceEntries:
+		content = SectorMap::Content::Binary;
+		break;
+	case CorruptionType::ZlibData:
+		content = SectorMap::Content::Compressed;
+		break;
+	default:
+		return 100; // Not searched for
+	}
+	if (searchLength == 0)
+		return 100;
+
+	// The windows on both sides of the last fragment
+	uint64_t fragmentEnd = info.pos.back()
+		+ nearestMultiple(info.sz.back(), interval);
+	uint64_t start = fragmentEnd > searchLength
+		? fragmentEnd - searchLength : 0;
+	start = std::max(start, startOffset);
+	uint64_t end = std::min(fragmentEnd + searchLength, endOffset);
+	if (end <= start)
+		return 1;
+
+	// Sectors which could hold part of the missing data, sampled evenly
+	uint64_t sectors = (end - start) / interval;
+	uint64_t step = std::max<uint64_t>(sectors / likelihoodSamples, 1)
+		* interval;
+	uint64_t sampled = 0;
+	uint64_t usable = 0;
+	for (uint64_t offset = start; offset < end; offset += step)
+	{
+		++sampled;
+		if (isFragmentCandidate(offset, content, interval))
+			++usable;
+	}
+
+	uint64_t needed = std::max<int64_t>(
+		(missing + interval - 1) / interval, 1);
+	uint64_t available = usable * sectors / sampled;
+	return std::clamp<uint64_t>(available * 100 / needed, 1, 100);
+}
+
+bool BundleRecovery::pastDeadline(int64_t deadline)
+{
+	return deadline != 0 && QDateTime::currentMSecsSinceEpoch() > deadline;
+}
+
+bool BundleRecovery::defragBundle(QIODevice& img, std::vector<FileInfo>& info,
+	const std::vector<Bundle>& bundles, std::vector<QByteArray>& debugData,
+	std::vector<std::vector<ResourceEntry>>& resources,
+	std::vector<CorruptionType>& corrupt, std::vector<BundleBuffer>& buffers,
+	int i, int64_t deadline, int threadId)
+{
+	// Skip intact bundles
+	if (corrupt[i] == CorruptionType::Intact
+		|| corrupt[i] == CorruptionType::Uncompressed)
+		return true;
+
+	// Reuse the result of a previous run
+	if (applyDefragCheckpoint(info[i], corrupt[i]))
+	{
+		if (corrupt[i] == CorruptionType::Intact)
+			claimFragments(info[i], info[i].pos.size());
+		return true;
+	}
+
+	//log("Defragging bundle at 0x"
+	//	+ QString::number(info[i].pos[0], 16).toUpper());
 
-			// Different fragment validation process per corruption type
-			switch (corrupt[i])
+	// Bundle data, read by validation and extended as fragments are found
+	BundleBuffer& buffer = buffers[i];
+
+	bool deferred = false;
+	// Find valid bundle fragments
+	while (corrupt[i] != CorruptionType::Intact
+		&& corrupt[i] != CorruptionType::Uncompressed)
+	{
+		bool breakLoop = false;
+
+		// Different fragment validation process per corruption type
+		switch (corrupt[i])
+		{
+		case CorruptionType::DebugData:
+			defragDebugData(img, info[i], bundles[i], buffer,
+				debugData[i], resources[i], corrupt[i], breakLoop,
+				threadId);
+			//breakLoop = true;
+			break;
+		case CorruptionType::ResourceId:
+			break;
+		case CorruptionType::ResourceEntries:
+			if (!strncmp(bundles[i].magic, "bndl", 4))
 			{
-			case CorruptionType::DebugData:
-				defragDebugData(image, info[i], bundles[i], debugData[i],
-					resources[i], corrupt[i], breakLoop, threadId);
-				//breakLoop = true;
-				break;
-			case CorruptionType::ResourceId:
-				break;
-			case CorruptionType::ResourceEntries:
-				if (!strncmp(bundles[i].magic, "bndl", 4))
-				{
-					// TODO
-				}
-				else
-				{
-					defragResourceEntriesBnd2(image, info[i], bundles[i],
-						resources[i], corrupt[i], breakLoop, threadId);
-				}
-				break;
-			case CorruptionType::ResourceCompressionInfo:
-				break;
-			case CorruptionType::ResourceImports:
-				break;
-			case CorruptionType::ZlibData:
-				// For each potential fragment
-				for (int p = 0; p < potentials.size(); ++p)
-				{
-					defragZlibData(image, potentials, bundles[i],
-						resources[i], corrupt[i], prevResourceIndex,
-						prevChunkIndex, breakLoop, searchedAll, p, threadId);
-				}
-				//breakLoop = true;
-				break;
+				// TODO
 			}
-
-			if (breakLoop)
-				break;
+			else
+			{
+				defragResourceEntriesBnd2(img, info[i], bundles[i],
+					buffer, resources[i], corrupt[i], breakLoop, threadId);
+			}
+			break;
+		case CorruptionType::ResourceCompressionInfo:
+			break;
+		case CorruptionType::ResourceImports:
+			break;
+		case CorruptionType::ZlibData:
+			// Searches for every remaining fragment at once
+			if (!defragZlibData(img, info[i], bundles[i], buffer,
+				resources[i], corrupt[i], deferred, i, deadline, threadId))
+				return false;
+			breakLoop = true;
+			break;
 		}
 
-		// Add the potential fragments to info for extraction
-		//info[i] = potentials[0];
-		//for (int j = 1; j < potentials.size(); ++j)
-		//	info.push_back(potentials[j]);
+		if (breakLoop)
+			break;
 	}
 
-	image.close();
-	uint64_t timeTaken = QDateTime::currentSecsSinceEpoch() - dateTimePre;
-	log("Thread " + QString::number(threadId)
-		+ " finished in " + QString::number(timeTaken) + " seconds");
+	// Checkpoint the result, unless it awaits a whole-image search
+	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+		return true;
+	if (deferred)
+		return true;
+	if (corrupt[i] == CorruptionType::Intact)
+		claimFragments(info[i], info[i].pos.size());
+	recordDefrag(info[i], corrupt[i]);
+	buffer = {};
+
+	return true;
+}
+
+void BundleRecovery::claimFragments(const FileInfo& info, int count)
+{
+	for (int i = 0; i < count; ++i)
+		claimedSectors.claim(info.pos[i], info.sz[i]);
+}
+
+CandidateOrder BundleRecovery::getCandidateOrder(uint64_t start,
+	uint64_t end, uint64_t fragmentPos)
+{
+	// Search as far back as forward, without going into the known fragment
+	uint64_t backEnd = fragmentPos > searchLength
+		? fragmentPos - searchLength : 0;
+	backEnd = std::max(backEnd, startOffset);
+
+	// Candidates nearest the fragment are tried first, so read them ahead
+	if (end > start)
+		prefetcher.prefetch(start, std::min(end - start, prefetchWindowSize));
+	if (fragmentPos > backEnd)
+	{
+		uint64_t size = std::min(fragmentPos - backEnd, prefetchWindowSize);
+		prefetcher.prefetch(fragmentPos - size, size);
+	}
+
+	return CandidateOrder(start, end, fragmentPos, backEnd, interval,
+		gapModel.likely(likelyGapCount));
+}
+
+bool BundleRecovery::isFragmentCandidate(uint64_t offset,
+	SectorMap::Content content, int size)
+{
+	return !claimedSectors.isClaimed(offset)
+		&& sectorMap.mayStartFragment(offset, content, size);
+}
+
+void BundleRecovery::readKnownData(QIODevice& img, const FileInfo& info,
+	BundleBuffer& buffer, int size)
+{
+	FileInfo known = info;
+	int knownSize = 0;
+	for (int i = 0; i < known.sz.size(); ++i)
+	{
+		known.sz[i] = nearestMultiple(known.sz[i], interval);
+		knownSize += known.sz[i];
+	}
+	readBundleData(img, known, buffer, knownSize + size);
 }
 
-void BundleRecovery::defragDebugData(QFile& img, FileInfo& info,
-	const Bundle& bundle, QString& debugData,
+void BundleRecovery::defragDebugData(QIODevice& img, FileInfo& info,
+	const Bundle& bundle, BundleBuffer& buffer, QByteArray& debugData,
 	std::vector<ResourceEntry>& resources, CorruptionType& corrupt,
 	bool& breakLoop, int threadId)
 {
@@ -106,17 +308,11 @@ void BundleRecovery::defragDebugData(QFile& img, FileInfo& info,
 	int bndlCorruptOffset = nearestMultiple(
 		getDebugDataFailPos(bundle, debugData), interval);
 
-	// Get known bundle data
-	QByteArray data;
-	for (int i = 0; i < info.pos.size(); ++i)
-	{
-		img.seek(info.pos[i]);
-		data.append(img.read(nearestMultiple(info.sz[i], interval)));
-	}
-
-	// Append corrupt data up to the start of the resource entries
+	// Get known bundle data, then the corrupt data up to the start of the
+	// resource entries. The bundle's buffer keeps what validation read.
 	int remaining = bundle.resourceEntriesOffset - bndlCorruptOffset;
-	data.append(img.read(remaining));
+	readKnownData(img, info, buffer, remaining);
+	QByteArray data = buffer.data;
 
 	// Create stream
 	QDataStream stream(&data, QIODevice::ReadWrite);
@@ -127,66 +323,79 @@ void BundleRecovery::defragDebugData(QFile& img, FileInfo& info,
 	uint64_t imgStartOffset = info.pos.back()
 		+ nearestMultiple(info.sz.back(), interval);
 	uint64_t imgEndOffset = imgStartOffset + searchLength;
+	CandidateOrder order = getCandidateOrder(imgStartOffset, imgEndOffset,
+		info.pos.back());
+
+	// The debug data before the fragment point is checked once, and the
+	// check resumes from there for each candidate
+	XmlChecker prefixChecker;
+	if (bndlCorruptOffset > bundle.debugDataOffset)
+		prefixChecker.feed(data.constData() + bundle.debugDataOffset,
+			bndlCorruptOffset - bundle.debugDataOffset);
+	int tailOffset = std::min<int>(bndlCorruptOffset + remaining, data.size());
+	std::vector<char> candidate(remaining);
 
 	bool defragged = false;
-	for (uint64_t i = imgStartOffset; i < imgEndOffset; i += interval)
+	for (uint64_t rank = 0; rank < order.size() && !prefixChecker.failed()
+		&& !prefixChecker.ended(); ++rank)
 	{
+		uint64_t i = order.at(rank);
+
+		// Skip sectors that can't start with the rest of the debug data
+		if (!isFragmentCandidate(i, SectorMap::Content::Text, remaining))
+			continue;
+
 		img.seek(i);
-		stream.device()->seek(bndlCorruptOffset);
-		stream.writeRawData(img.read(remaining), remaining);
-		stream.device()->seek(bundle.debugDataOffset);
-
-		// Test string
-		QString testDebugData = stream.device()->readAll();
-		// Remove trailing null data
-		for (int i = 0; i < testDebugData.size(); ++i)
-		{
-			if (testDebugData.at(i) == '\0')
-			{
-				testDebugData.truncate(i);
-				break;
-			}
-		}
-		if (!getDebugDataFailPos(bundle, testDebugData)
-			&& testDebugData.size() >= bundle.resourceEntriesOffset
+		if (img.read(candidate.data(), remaining) != remaining)
+			continue;
+
+		// Test the debug data up to the first null byte
+		XmlChecker checker = prefixChecker;
+		if (!checker.feed(candidate.data(), remaining))
+			continue;
+		checker.feed(data.constData() + tailOffset, data.size() - tailOffset);
+		int size = checker.offset();
+		if (checker.complete()
+			&& size >= bundle.resourceEntriesOffset
 			- bundle.debugDataOffset - 0x10
-			&& testDebugData.size() <= bundle.resourceEntriesOffset
+			&& size <= bundle.resourceEntriesOffset
 			- bundle.debugDataOffset)
 		{
 			defragged = true;
 
 			// Update info
-			debugData = testDebugData;
+			stream.device()->seek(bndlCorruptOffset);
+			stream.writeRawData(candidate.data(), remaining);
+			debugData = data.mid(bundle.debugDataOffset, size);
 			info.sz[0] = nearestMultiple(info.sz[0], interval); // Always 1 frag
 			info.pos.push_back(i);
 			info.sz.push_back(bundle.resourceDataOffset[0] - info.sz[0]); // Tmp
 
 			// Read in resource entries for determining corruption type
-			img.seek(info.pos[1] + bundle.resourceEntriesOffset - info.sz[0]);
-			stream.device()->seek(bundle.resourceEntriesOffset);
-			int entSizeToRead = ResourceEntrySize(bundle)
-				* bundle.resourceEntriesCount;
-			stream.writeRawData(img.read(entSizeToRead), entSizeToRead);
-			stream.device()->seek(bundle.resourceEntriesOffset);
+			readBundleData(img, info, buffer);
+			QDataStream entries(buffer.data);
+			if (endianness == std::endian::little)
+				entries.setByteOrder(QDataStream::LittleEndian);
+			entries.skipRawData(bundle.resourceEntriesOffset);
 			int chunkCount = GetChunkCount(bundle);
 			for (int j = 0; j < bundle.resourceEntriesCount; ++j)
 			{
-				stream >> resources[j].resourceId;
+				entries >> resources[j].resourceId;
 				if (bundle.version <= 3)
-					stream >> resources[j].importHash;
+					entries >> resources[j].importHash;
 				for (int k = 0; k < chunkCount; ++k)
-					stream >> resources[j].uncompressedSaa[k];
+					entries >> resources[j].uncompressedSaa[k];
 				for (int k = 0; k < chunkCount; ++k)
-					stream >> resources[j].saaOnDisk[k];
+					entries >> resources[j].saaOnDisk[k];
 				for (int k = 0; k < chunkCount; ++k)
-					stream >> resources[j].diskOffset[k];
-				stream >> resources[j].importOffset;
-				stream >> resources[j].resourceTypeId;
-				stream >> resources[j].importCount;
-				stream >> resources[j].flags;
-				stream >> resources[j].streamIndex;
+					entries >> resources[j].diskOffset[k];
+				entries >> resources[j].importOffset;
+				entries >> resources[j].resourceTypeId;
+				entries >> resources[j].importCount;
+				entries >> resources[j].flags;
+				entries >> resources[j].streamIndex;
 				if (bundle.version == 5)
-					stream.skipRawData(4);
+					entries.skipRawData(4);
 			}
 			int intendedSize = GetBundleSize(bundle, resources);
 
@@ -203,13 +412,6 @@ void BundleRecovery::defragDebugData(QFile& img, FileInfo& info,
 			else
 				info.sz[1] = intendedSize - info.sz[0];
 
-			// Read in resources for determining corruption type
-			img.seek(info.pos[1] + bundle.resourceDataOffset[0] - info.sz[0]);
-			stream.device()->seek(bundle.resourceDataOffset[0]);
-			int resSizeToRead = intendedSize - bundle.resourceDataOffset[0];
-			stream.writeRawData(img.read(resSizeToRead), resSizeToRead);
-			stream.device()->seek(bundle.resourceDataOffset[0]);
-
 			// Determine if bundle resources are corrupt
 			if (!(bundle.flags & 1))
 			{
@@ -218,8 +420,9 @@ void BundleRecovery::defragDebugData(QFile& img, FileInfo& info,
 			}
 			else
 			{
+				readBundleData(img, info, buffer);
 				int resFailPos = getCompressedResourcesFailPos(
-					img, info, bundle, resources);
+					buffer, bundle, resources);
 				if (resFailPos)
 				{
 					info.sz.back() = resFailPos;
@@ -234,6 +437,7 @@ void BundleRecovery::defragDebugData(QFile& img, FileInfo& info,
 
 	if (defragged)
 	{
+		gapModel.record(info.pos.back() - imgStartOffset);
 		log("Bundle at 0x" + QString::number(info.pos[0], 16).toUpper()
 		+ ": defragged debug data");
 	}
@@ -245,29 +449,25 @@ void BundleRecovery::defragDebugData(QFile& img, FileInfo& info,
 	}
 }
 
-void BundleRecovery::defragResourceEntriesBnd2(QFile& img, FileInfo& info,
-	const Bundle& bundle, std::vector<ResourceEntry>& resources,
-	CorruptionType& corrupt, bool& breakLoop, int threadId)
+void BundleRecovery::defragResourceEntriesBnd2(QIODevice& img, FileInfo& info,
+	const Bundle& bundle, BundleBuffer& buffer,
+	std::vector<ResourceEntry>& resources, CorruptionType& corrupt,
+	bool& breakLoop, int threadId)
 {
 	// Exact offset of the fragmentation in the bundle and entries
 	int bndlCorruptOffset = nearestMultiple(
 		getResourceEntriesFailPos(bundle, resources), interval);
 	int entCorruptOffset = bndlCorruptOffset - bundle.resourceEntriesOffset;
 
-	// Get known bundle data
-	QByteArray data;
-	for (int i = 0; i < info.pos.size(); ++i)
-	{
-		img.seek(info.pos[i]);
-		data.append(img.read(nearestMultiple(info.sz[i], interval)));
-	}
-
-	// Append corrupt data up to the start of the resource data, then remove
-	// anything not meant as part of the resource entries
+	// Get known bundle data, then the corrupt data up to the start of the
+	// resource data. The bundle's buffer keeps what validation read.
 	int remaining = bundle.resourceDataOffset[0] - bndlCorruptOffset;
-	data.append(img.read(remaining));
-	data.remove(0, bundle.resourceEntriesOffset);
-	data.squeeze();
+	readKnownData(img, info, buffer, remaining);
+
+	// Only the resource entries are tested
+	QByteArray data = buffer.data.mid(bundle.resourceEntriesOffset);
+	if (data.size() < entCorruptOffset + remaining)
+		data.resize(entCorruptOffset + remaining);
 
 	// Create stream
 	QDataStream stream(&data, QIODevice::ReadWrite);
@@ -282,16 +482,32 @@ void BundleRecovery::defragResourceEntriesBnd2(QFile& img, FileInfo& info,
 	// Index of the first resource entry with corruption
 	int entryIndex = entCorruptOffset / ResourceEntrySize(bundle);
 
+	// Entries that fit in the data, in case the header is corrupt
+	int entryCount = std::min<int>(bundle.resourceEntriesCount,
+		data.size() / ResourceEntrySize(bundle));
+
 	// Append data equal in size to the remaining resource entries and validate
 	std::vector<ResourceEntry> testResources = resources;
 	int8_t chunkCount = GetChunkCount(bundle);
 	bool defragged = false;
-	for (uint64_t i = imgStartOffset; i < imgEndOffset; i += interval)
+	CandidateOrder order = getCandidateOrder(imgStartOffset, imgEndOffset,
+		info.pos.back());
+	for (uint64_t rank = 0; rank < order.size(); ++rank)
 	{
-		// Read the new entries into data, then into the entries vector
+		uint64_t i = order.at(rank);
+
+		// Skip sectors that can't start with resource entries
+		if (!isFragmentCandidate(i, SectorMap::Content::Binary, remaining))
+			continue;
+
+		// Read the new entries into data, then into the entries vector if
+		// they look valid
 		img.seek(i);
-		stream.device()->seek(entCorruptOffset);
-		stream.writeRawData(img.read(remaining), remaining);
+		if (img.read(data.data() + entCorruptOffset, remaining) != remaining)
+			continue;
+		if (getRawResourceEntriesFailIndex(bundle, data.constData(), entryIndex,
+			entryCount) != -1)
+			continue;
 		stream.device()->seek(ResourceEntrySize(bundle) * entryIndex);
 		for (int j = entryIndex; j < bundle.resourceEntriesCount; ++j)
 		{
@@ -323,8 +539,9 @@ void BundleRecovery::defragResourceEntriesBnd2(QFile& img, FileInfo& info,
 			info.sz[info.sz.size() - 2]
 				= nearestMultiple(info.sz[info.sz.size() - 2], interval);
 			info.sz.back() = intendedSize - info.sz[info.sz.size() - 2];
+			readBundleData(img, info, buffer);
 			int failPos = getCompressedResourcesFailPos(
-				img, info, bundle, resources);
+				buffer, bundle, resources);
 			//if (!failPos)
 			//{
 			//	info.sz.back() = (intendedSize - bundle.resourceDataOffset[0]);
@@ -349,6 +566,7 @@ void BundleRecovery::defragResourceEntriesBnd2(QFile& img, FileInfo& info,
 
 	if (defragged)
 	{
+		gapModel.record(info.pos.back() - imgStartOffset);
 		log("Bundle at 0x" + QString::number(info.pos[0], 16).toUpper()
 			+ ": defragged entries");
 	}
@@ -360,272 +578,707 @@ void BundleRecovery::defragResourceEntriesBnd2(QFile& img, FileInfo& info,
 	}
 }
 
-void BundleRecovery::defragZlibData(QFile& img, std::vector<FileInfo>& info,
-	const Bundle& bundle, const std::vector<ResourceEntry>& resources,
-	CorruptionType& corrupt, int& prevResource, int& prevChunk, bool& breakLoop,
-	bool& searchedAll, int p, int threadId)
+bool BundleRecovery::defragZlibData(QIODevice& img, FileInfo& info,
+	const Bundle& bundle, BundleBuffer& buffer,
+	const std::vector<ResourceEntry>& resources, CorruptionType& corrupt,
+	bool& deferred, int bundleIndex, int64_t deadline, int threadId)
 {
-	int intendedSize = GetBundleSize(bundle, resources);
-
-	libdeflate_decompressor* dc = libdeflate_alloc_decompressor();
-
 	if (!strncmp(bundle.magic, "bndl", 4))
 	{
 		// TODO
 		// No bundles have zlib corruption - need samples
+		return true;
 	}
-	else
+
+	int intendedSize = GetBundleSize(bundle, resources);
+
+	// Continue where the search stopped if the bundle ran out of time before
+	ZlibSearch search;
+	bool resumed = false;
+	zlibSearchesMutex.lock();
+	auto saved = zlibSearches.find(bundleIndex);
+	if (saved != zlibSearches.end())
 	{
-		// Get known bundle data
-		QByteArray bundleData;
-		for (int i = 0; i < info[p].pos.size(); ++i)
-		{
-			img.seek(info[p].pos[i]);
-			bundleData.append(img.read(info[p].sz[i]));
-		}
+		search = std::move(saved->second);
+		zlibSearches.erase(saved);
+		resumed = true;
+	}
+	zlibSearchesMutex.unlock();
+	if (!resumed)
+	{
+		search.beam.resize(1);
+		search.beam[0].info = info;
+		search.beam[0].buffer = buffer;
+		search.beam[0].corrupt = corrupt;
+	}
 
-		// Append corrupt data so the corrupt resource index can be
-		// gotten
-		int notRead = intendedSize - bundleData.size();
-		bundleData.append(img.read(notRead));
-
-		// Create stream
-		QDataStream stream(&bundleData, QIODevice::ReadOnly);
-		if (endianness == std::endian::little)
-			stream.setByteOrder(QDataStream::LittleEndian);
-
-		// Use libdeflate to find the corrupt resource and store its
-		// index and chunk index
-		int resourceIndex = -1;
-		int chunkIndex = -1;
-		bool hasSetCorruptIndex = false;
-		for (int i = 0; i < GetChunkCount(bundle); ++i)
+	bool solved = false;
+	while (!search.beam.empty() && !solved)
+	{
+		if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+			return true;
+
+		for (; search.expanded < search.beam.size(); ++search.expanded)
 		{
-			for (int j = 0; j < resources.size(); ++j)
+			ZlibHypothesis& hypothesis = search.beam[search.expanded];
+			if (!expandZlibHypothesis(img, hypothesis, search.children, bundle,
+				resources, intendedSize, deadline, threadId))
 			{
-				if (!GetSizeFromSAA(resources[j].saaOnDisk[i]))
-					continue;
-				int cSz = GetSizeFromSAA(resources[j].saaOnDisk[i]);
-				int uSz = GetSizeFromSAA(resources[j].uncompressedSaa[i]);
-				std::unique_ptr<char[]> resourceData(new char[cSz]);
-				stream.device()->seek(bundle.resourceDataOffset[i]
-					+ resources[j].diskOffset[i]);
-				stream.readRawData(resourceData.get(), cSz);
-				int result = GetLibdeflateResult(
-					resourceData.get(), cSz, uSz, dc);
-				if (result != 0)
+				// Kept to resume from once the easier bundles are done
+				zlibSearchesMutex.lock();
+				zlibSearches[bundleIndex] = std::move(search);
+				zlibSearchesMutex.unlock();
+				return false;
+			}
+
+			bool expanded = false;
+			for (ZlibHypothesis& child : search.children)
+			{
+				// Every fragment must fix at least one resource
+				if (child.validSize > hypothesis.validSize)
 				{
-					resourceIndex = j;
-					chunkIndex = i;
-					hasSetCorruptIndex = true;
-					break;
+					search.next.push_back(std::move(child));
+					expanded = true;
 				}
 			}
-			if (hasSetCorruptIndex)
-				break;
+			search.children.clear();
+			if (!expanded && (!search.failed
+				|| isBetterHypothesis(hypothesis, search.best)))
+			{
+				search.best = std::move(hypothesis);
+				search.failed = true;
+			}
+		}
+
+		// Keep the best scoring chains, in the order they were found if tied
+		std::stable_sort(search.next.begin(), search.next.end(),
+			isBetterHypothesis);
+		if (search.next.size() > beamWidth)
+			search.next.resize(beamWidth);
+		search.beam = std::move(search.next);
+		search.next.clear();
+		search.expanded = 0;
+
+		solved = !search.beam.empty()
+			&& search.beam[0].corrupt == CorruptionType::Intact;
+	}
+
+	ZlibHypothesis& result = solved ? search.beam[0] : search.best;
+	for (int64_t gap : result.gaps)
+		gapModel.record(gap);
+	info = result.info;
+	buffer = result.buffer;
+	corrupt = result.corrupt;
+	if (solved)
+		return true;
+
+	// Only the last fragment of the chain is in question
+	claimFragments(info, info.pos.size() - 1);
+
+	// Queue a search of the whole image, which is done for all bundles at
+	// once after every bundle has been searched near its fragments
+	if (ui.checkBoxSearchAll->isChecked() && !result.query.truncations.empty())
+	{
+		log("T" + QString::number(threadId) + " Bundle at 0x"
+			+ QString::number(info.pos[0], 16).toUpper()
+			+ ": queued search of whole image");
+
+		result.query.bundle = bundleIndex;
+		zlibQueriesMutex.lock();
+		zlibQueries.push_back(result.query);
+		zlibQueriesMutex.unlock();
+
+		deferred = true;
+		return true;
+	}
+
+	log("T" + QString::number(threadId) + " Bundle at 0x"
+		+ QString::number(info.pos[0], 16).toUpper()
+		+ ": failed to defrag resources");
+
+	// Make end size the remainder of the bundle, if it isn't already
+	info.sz.back() = intendedSize;
+	for (int i = 0; i < info.sz.size() - 1; ++i)
+		info.sz.back() -= info.sz[i];
+
+	return true;
+}
+
+bool BundleRecovery::expandZlibHypothesis(QIODevice& img,
+	ZlibHypothesis& hypothesis, std::vector<ZlibHypothesis>& children,
+	const Bundle& bundle, const std::vector<ResourceEntry>& resources,
+	int intendedSize, int64_t deadline, int threadId)
+{
+	FileInfo& info = hypothesis.info;
+
+	// Get known bundle data, appending corrupt data so the corrupt
+	// resource index can be gotten
+	readBundleData(img, info, hypothesis.buffer, intendedSize);
+	const QByteArray& data = hypothesis.buffer.data;
+
+	int resourceIndex = -1;
+	int chunkIndex = -1;
+	if (checkCompressedResources(hypothesis.buffer, bundle, resources,
+		hypothesis.validResources, INT_MAX, resourceIndex, chunkIndex))
+		return true;
+
+	// For decompression
+	int cSz = GetSizeFromSAA(
+		resources[resourceIndex].saaOnDisk[chunkIndex]);
+	int uSz = GetSizeFromSAA(
+		resources[resourceIndex].uncompressedSaa[chunkIndex]);
+	int resourceOffset = bundle.resourceDataOffset[chunkIndex]
+		+ resources[resourceIndex].diskOffset[chunkIndex];
+
+	// Offset to start truncating the data at
+	int bndlStartOffset = binaryio::Align(resourceOffset, interval);
+
+	// Offset to stop truncating the data at, the end of the resource or of
+	// the data read if that is shorter
+	int bndlEndOffset = std::min<int>(resourceOffset + cSz, data.size());
+
+	// Offset in the image to start searching for valid fragments
+	uint64_t imgStartOffset = bndlStartOffset;
+	// Make it relative to the last known file fragment
+	for (int i = 0; i < info.sz.size() - 1; ++i)
+		imgStartOffset -= info.sz[i];
+	imgStartOffset += info.pos.back();
+
+	// The offset to stop searching the image at
+	uint64_t imgEndOffset = imgStartOffset + searchLength;
+	if (imgEndOffset > endOffset)
+		imgEndOffset = endOffset;
+
+	// Candidates are tried most likely first
+	CandidateOrder order = getCandidateOrder(imgStartOffset, imgEndOffset,
+		info.pos.back());
+
+	// Resources starting in the same sector as this one ends
+	std::vector<int> anchors = getZlibAnchors(bundle, resources,
+		resourceOffset + cSz);
+
+	// The resource up to the truncation point is decoded once and only
+	// the bytes read from each candidate offset are inflated after it
+	Inflater inflater;
+	inflater.reset(uSz);
+
+	// Truncate data from every interval until reaching end of resource
+	for (int i = bndlStartOffset; i < bndlEndOffset
+		&& children.size() < beamWidth; i += interval)
+	{
+		int corruptionOffset = i - resourceOffset; // Corruption in resource
+		int resourceRemaining = cSz - corruptionOffset;
+
+		// If the data before the truncation point is already invalid, no
+		// continuation can fix it
+		if (!inflater.advance(data.constData() + resourceOffset,
+			corruptionOffset))
+			continue;
+
+		// Truncation points searched before running out of time are done
+		if (i < hypothesis.truncation)
+			continue;
+
+		// Search every interval for the remaining data
+		std::vector<int> relativeAnchors;
+		for (int anchor : anchors)
+			relativeAnchors.push_back(anchor - i);
+		std::vector<uint64_t> matches = findZlibContinuations(inflater, order,
+			resourceRemaining, relativeAnchors, beamWidth - children.size(),
+			deadline);
+
+		// Searches cut short by the deadline are incomplete, so this
+		// truncation point is searched again on resuming
+		if (pastDeadline(deadline))
+		{
+			hypothesis.truncation = i;
+			return false;
 		}
 
-		// Check if the current indices match the previous
-		// This indicates failure to defragment, so break out
-		if (resourceIndex == prevResource
-			&& chunkIndex == prevChunk)
+		for (uint64_t j : matches)
 		{
-			//if (ui.checkBoxSearchAll->isChecked())
-			//{
-			//	logger->log("T" + QString::number(threadId) + " Bundle at 0x"
-			//		+ QString::number(info[p].pos[0], 16).toUpper()
-			//		+ ": fragment not within search length, searching all");
-			//
-			//	// Make end size the remainder of the bundle, if it isn't already
-			//	info[p].sz.back() = intendedSize;
-			//	for (int i = 0; i < info[p].sz.size() - 1; ++i)
-			//		info[p].sz.back() -= info[p].sz[i];
-			//}
-			//else
-			//{
-				log("T" + QString::number(threadId) + " Bundle at 0x"
-					+ QString::number(info[p].pos[0], 16).toUpper()
-					+ ": failed to defrag resources");
-
-				// Make end size the remainder of the bundle, if it isn't already
-				info[p].sz.back() = intendedSize;
-				for (int i = 0; i < info[p].sz.size() - 1; ++i)
-					info[p].sz.back() -= info[p].sz[i];
-				breakLoop = true;
-				return;
-			//}
+			ZlibHypothesis child;
+			child.info = info;
+			child.buffer = hypothesis.buffer;
+			child.corrupt = hypothesis.corrupt;
+			child.validResources = hypothesis.validResources;
+			child.anchorHits = hypothesis.anchorHits;
+			child.gaps = hypothesis.gaps;
+			child.gaps.push_back(j - imgStartOffset);
+			applyZlibFragment(img, child.info, bundle, child.buffer, resources,
+				child.validResources, child.corrupt, i, j, intendedSize,
+				threadId);
+
+			// Fragments before the last have their final sizes, and the
+			// last is cut where decompression fails
+			for (int size : child.info.sz)
+				child.validSize += size;
+
+			// Candidates only had to have a zlib header somewhere in each
+			// anchor's sector, so count those exactly where expected
+			const QByteArray& childData = child.buffer.data;
+			for (int anchor : anchors)
+				if (anchor + 1 < childData.size()
+					&& static_cast<uchar>(childData[anchor]) == 0x78
+					&& static_cast<uchar>(childData[anchor + 1]) == 0xDA)
+					++child.anchorHits;
+
+			children.push_back(std::move(child));
 		}
+	}
+
+	if (children.empty())
+	{
+		ZlibQuery& query = hypothesis.query;
+		query.info = info;
+		query.resource = data.mid(resourceOffset, bndlEndOffset
+			- resourceOffset);
+		query.resourceOffset = resourceOffset;
+		query.uncompressedSize = uSz;
+		query.intendedSize = intendedSize;
+		for (int i = bndlStartOffset; i < bndlEndOffset; i += interval)
+			query.truncations.push_back(i);
+		query.anchors = anchors;
+	}
+
+	return true;
+}
+
+bool BundleRecovery::isBetterHypothesis(const ZlibHypothesis& a,
+	const ZlibHypothesis& b)
+{
+	// Most data decompressing first, then most zlib headers where expected,
+	// then fewest fragments
+	if (a.validSize != b.validSize)
+		return a.validSize > b.validSize;
+	if (a.anchorHits != b.anchorHits)
+		return a.anchorHits > b.anchorHits;
+	return a.info.pos.size() < b.info.pos.size();
+}
 
-		// Offset to start truncating the data at
-		int bndlStartOffset = binaryio::Align(
+void BundleRecovery::applyZlibFragment(QIODevice& img, FileInfo& info,
+	const Bundle& bundle, BundleBuffer& buffer,
+	const std::vector<ResourceEntry>& resources,
+	std::vector<bool>& validResources, CorruptionType& corrupt,
+	int truncation, uint64_t offset, int intendedSize, int threadId)
+{
+	// Set new sizes
+	info.sz.back() = truncation;
+	for (int k = 0; k < info.sz.size() - 1; ++k)
+		info.sz.back() -= info.sz[k];
+	info.pos.push_back(offset);
+
+	// Set size to remaining size until it can be confirmed
+	int remaining = intendedSize;
+	for (int k = 0; k < info.sz.size(); ++k)
+		remaining -= info.sz[k];
+	info.sz.push_back(remaining);
+
+	// Check what the new corrupt resource is, or if there is
+	// no longer a corrupt resource, set the size to the remainder. Resources
+	// before the truncation point are unchanged, so aren't checked again.
+	readBundleData(img, info, buffer);
+	int resourceIndex = -1;
+	int chunkIndex = -1;
+	bool invalid = !checkCompressedResources(buffer, bundle, resources,
+		validResources, truncation, resourceIndex, chunkIndex);
+
+	if (invalid)
+	{
+		// Get an estimate of the correct fragment size
+		info.sz.back() = getCompressedResourceFailPos(buffer,
 			bundle.resourceDataOffset[chunkIndex]
 			+ resources[resourceIndex].diskOffset[chunkIndex],
-			interval);
-
-		// Offset to stop truncating the data at
-		int bndlEndOffset = bundle.resourceDataOffset[chunkIndex]
-			+ resources[resourceIndex].diskOffset[chunkIndex]
-			+ resources[resourceIndex].saaOnDisk[chunkIndex];
-
-		// Offset in the image to start searching for valid fragments
-		uint64_t imgStartOffset = bndlStartOffset;
-		// Make it relative to the last known file fragment
-		for (int i = 0; i < info[p].sz.size() - 1; ++i)
-			imgStartOffset -= info[p].sz[i];
-		imgStartOffset += info[p].pos.back();
-
-		// The offset to stop searching the image at
-		uint64_t imgEndOffset = imgStartOffset + searchLength;
-		if (imgEndOffset > endOffset)
-			imgEndOffset = endOffset;
-
-		// For decompression
-		int cSz = GetSizeFromSAA(
-			resources[resourceIndex].saaOnDisk[chunkIndex]);
-		int uSz = GetSizeFromSAA(
-			resources[resourceIndex].uncompressedSaa[chunkIndex]);
-		int resourceOffset = bundle.resourceDataOffset[chunkIndex]
-			+ resources[resourceIndex].diskOffset[chunkIndex];
-
-		bool resourceDefragged = false;
-
-		// Truncate data from every interval until reaching end of resource
-		// TODO: Somehow optimize this so it takes 1/6th the time, like FF does
-		for (int i = bndlStartOffset; i < bndlEndOffset; i += interval)
+			GetSizeFromSAA(resources[resourceIndex].saaOnDisk[chunkIndex]),
+			GetSizeFromSAA(
+				resources[resourceIndex].uncompressedSaa[chunkIndex]));
+		for (int i = 0; i < info.sz.size() - 1; ++i)
+			info.sz.back() -= info.sz[i];
+	}
+
+	log("T" + QString::number(threadId)
+		+ " Bundle at 0x" + QString::number(info.pos[0], 16).toUpper()
+		+ ": data fragment at 0x"
+		+ QString::number(info.pos.back(), 16).toUpper() + " for 0x"
+		+ QString::number(info.sz.back(), 16).toUpper());
+
+	if (!invalid)
+	{
+		corrupt = CorruptionType::Intact;
+		log("T" + QString::number(threadId) + " Bundle at 0x"
+			+ QString::number(info.pos[0], 16).toUpper()
+			+ " is intact");
+	}
+}
+
+std::vector<int> BundleRecovery::getZlibAnchors(const Bundle& bundle,
+	const std::vector<ResourceEntry>& resources, int end)
+{
+	std::vector<int> anchors;
+	int sectorEnd = binaryio::Align(end, interval);
+	for (int i = 0; i < GetChunkCount(bundle); ++i)
+	{
+		for (int j = 0; j < resources.size(); ++j)
 		{
-			int corruptionOffset = i - resourceOffset; // Corruption in resource
-			int resourceRemaining = cSz - corruptionOffset;
-			QByteArray testData(bundleData.sliced(resourceOffset, cSz));
-			//QDataStream testStream(&testData, QIODevice::ReadWrite);
-			//char* unFragmented = new char[corruptionOffset];
-			//stream.device()->seek(resourceOffset);
-			//stream.readRawData(unFragmented, corruptionOffset);
-			//std::stringstream* t = new std::stringstream;
-			//t->write(unFragmented, corruptionOffset);
-
-			// Read in data from every interval as the remaining data
-			for (uint64_t j = imgStartOffset; j < imgEndOffset; j += interval)
+			if (!GetSizeFromSAA(resources[j].saaOnDisk[i]))
+				continue;
+			int offset = bundle.resourceDataOffset[i]
+				+ resources[j].diskOffset[i];
+			if (offset >= end && offset < sectorEnd)
+				anchors.push_back(offset);
+		}
+	}
+
+	return anchors;
+}
+
+bool BundleRecovery::hasZlibAnchors(uint64_t offset,
+	const std::vector<int>& anchors)
+{
+	for (int anchor : anchors)
+		if (!sectorMap.mayHaveZlibHeader(offset + anchor))
+			return false;
+
+	return true;
+}
+
+bool BundleRecovery::testZlibCandidate(const Inflater& inflater,
+	const char* data, int size, bool probe, uint64_t state,
+	std::vector<Bytef>& scratch, uint64_t& lookups, uint64_t& hits)
+{
+	uint64_t key = ContinuationMemo::key(data, size, state * 2 + probe);
+	bool result;
+	++lookups;
+	if (continuationMemo.find(key, result))
+	{
+		++hits;
+		return result;
+	}
+
+	if (probe)
+		result = inflater.probe(data, size, scratch);
+	else
+		result = inflater.test(data, size, scratch);
+	continuationMemo.insert(key, result);
+
+	return result;
+}
+
+std::vector<uint64_t> BundleRecovery::findZlibContinuations(
+	const Inflater& inflater, const CandidateOrder& order, int size,
+	const std::vector<int>& anchors, int count, int64_t deadline)
+{
+	std::vector<uint64_t> found;
+	if (count <= 0 || order.size() == 0)
+		return found;
+
+	// Ranks are split into chunks searched on any idle thread. Each chunk
+	// keeps its own matches, and chunks after the first ones holding count
+	// matches between them are skipped, so the result doesn't depend on
+	// thread timing.
+	int chunkCount = (order.size() + candidatesPerChunk - 1)
+		/ candidatesPerChunk;
+	std::vector<std::vector<uint64_t>> matches(chunkCount);
+	std::vector<bool> searched(chunkCount);
+	int settled = 0; // Chunks searched in full before any not yet searched
+	int settledMatches = 0; // Matches in the settled chunks
+	std::atomic<int> lastNeeded = chunkCount - 1;
+	QMutex mutex;
+	uint64_t state = memoStates++; // The inflater's state, for the memo
+
+	executor.run(chunkCount,
+		[&](int chunk, int)
+		{
+			if (chunk > lastNeeded
+				|| !ui.pushButtonStop->isEnabled() // Cancel pressed
+				|| pastDeadline(deadline))
+				return;
+
+			CachedImage image(imageCache);
+			std::vector<Bytef> scratch;
+			uint64_t lookups = 0;
+			uint64_t hits = 0;
+			std::vector<uint64_t>& chunkMatches = matches[chunk];
+			uint64_t first = chunk * candidatesPerChunk;
+			uint64_t last = std::min(first + candidatesPerChunk, order.size());
+			for (uint64_t rank = first; rank < last && chunk <= lastNeeded
+				&& chunkMatches.size() < count; ++rank)
 			{
-				const auto timeForJ = std::chrono::steady_clock::now();
-				const auto timeForIf = std::chrono::steady_clock::now();
-				if (searchedAll == true && (j & 0xFFFFFF) == 0)
-				{
-					log("T" + QString::number(threadId) + " Bundle at 0x"
-						+ QString::number(info[p].pos[0], 16).toUpper()
-						+ ": searching 0x" + QString::number(j, 16).toUpper());
-				}
-				const auto durForIf = std::chrono::steady_clock::now() - timeForIf;
-
-				const auto timeForSeek1 = std::chrono::steady_clock::now();
-				img.seek(j);
-				const auto durForSeek1 = std::chrono::steady_clock::now() - timeForSeek1;
-				//const auto timeForSeek2 = std::chrono::steady_clock::now();
-				//testStream.device()->seek(corruptionOffset);
-				//const auto durForSeek2 = std::chrono::steady_clock::now() - timeForSeek2;
-				const auto timeForWrite = std::chrono::steady_clock::now();
-				//testStream.writeRawData(img.read(resourceRemaining),
-				//	resourceRemaining);
-				testData.replace(corruptionOffset, resourceRemaining,
-					img.read(resourceRemaining));
-				const auto durForWrite = std::chrono::steady_clock::now() - timeForWrite;
-				//const auto timeForSeek3 = std::chrono::steady_clock::now();
-				//testStream.device()->seek(0);
-				//const auto durForSeek3 = std::chrono::steady_clock::now() - timeForSeek3;
-
-				//char* buffer = new char[resourceRemaining];
-				//stream.device()->seek(resourceOffset);
-				//stream.readRawData(buffer, resourceRemaining);
-				//t->seekp(corruptionOffset);
-				//t->write(buffer, resourceRemaining);
-				//char* resource = new char[cSz];
-				//t->seekg(0);
-				//t->read(resource, cSz);
-
-				//if (GetLibdeflateResult(
-				//	resource, cSz, uSz) == LIBDEFLATE_SUCCESS)
-
-				const auto timeForZlibTest = std::chrono::steady_clock::now();
-				if (GetLibdeflateResult(/*testStream.device()->readAll().data()*/testData.data(),
-					cSz, uSz, dc) == LIBDEFLATE_SUCCESS)
+				uint64_t j = order.at(rank);
+				if (!isFragmentCandidate(j, SectorMap::Content::Compressed,
+					size) || !hasZlibAnchors(j, anchors))
+					continue;
+
+				// Reject most candidates from their first few KB
+				image.seek(j);
+				QByteArray continuation
+					= image.read(std::min(size, zlibProbeSize));
+				if (size > zlibProbeSize)
 				{
-					// Set new sizes
-					info[p].sz.back() = i;
-					for (int k = 0; k < info[p].sz.size() - 1; ++k)
-						info[p].sz.back() -= info[p].sz[k];
-					info[p].pos.push_back(j);
-
-					// Set size to remaining size until it can be confirmed
-					int remaining = intendedSize;
-					for (int k = 0; k < info[p].sz.size(); ++k)
-						remaining -= info[p].sz[k];
-					info[p].sz.push_back(remaining);
-
-					//delete[] buffer;
-					//delete[] resource;
-
-					resourceDefragged = true;
-					break;
+					if (!testZlibCandidate(inflater, continuation.constData(),
+						continuation.size(), true, state, scratch, lookups,
+						hits))
+						continue;
+					continuation.append(image.read(size - zlibProbeSize));
 				}
-				const auto durForZlibTest = std::chrono::steady_clock::now() - timeForZlibTest;
 
-				const auto durForJ = std::chrono::steady_clock::now() - timeForJ;
-				if (info[p].pos[0] == 0x4F3D11000 && searchedAll)
-					if (true);
-
-				//delete[] buffer;
-				//delete[] resource;
+				if (testZlibCandidate(inflater, continuation.constData(),
+					continuation.size(), false, state, scratch, lookups, hits))
+					chunkMatches.push_back(j);
 			}
-			//delete[] unFragmented;
-			//delete t;
-			if (resourceDefragged)
-				break;
-			else if (!resourceDefragged && i + interval > bndlEndOffset
-				&& ui.checkBoxSearchAll->isChecked())
+			continuationMemo.count(lookups, hits);
+			image.close();
+
+			// Once the chunks searched in order hold count matches, the
+			// rest aren't needed
+			QMutexLocker locker(&mutex);
+			searched[chunk] = true;
+			while (settled < chunkCount && searched[settled]
+				&& settledMatches < count)
 			{
-				log("T" + QString::number(threadId) + " Bundle at 0x"
-					+ QString::number(info[p].pos[0], 16).toUpper()
-					+ ": searching whole image");
-
-				i = bndlStartOffset;
-				imgStartOffset = startOffset;
-				imgEndOffset = endOffset;
-				searchedAll = true;
+				settledMatches += matches[settled].size();
+				if (settledMatches >= count)
+					lastNeeded = settled;
+				++settled;
 			}
-		}
+		});
+
+	// Candidates are in order, so the first count matches are the most likely
+	for (int chunk = 0; chunk <= lastNeeded && found.size() < count; ++chunk)
+		for (int k = 0; k < matches[chunk].size() && found.size() < count; ++k)
+			found.push_back(matches[chunk][k]);
+
+	return found;
+}
 
-		// Check what the new corrupt resource is, or if there is
-		// no longer a corrupt resource, set the size to the remainder
-		if (resourceDefragged)
+void BundleRecovery::searchZlibQueries(std::vector<ZlibQuery>& queries)
+{
+	// Saved inflate states take the most memory, so split the queries into
+	// batches that fit the limit, each of which needs its own pass
+	for (int first = 0; first < queries.size();)
+	{
+		int last = first;
+		uint64_t batchMemory = 0;
+		while (last < queries.size() && (last == first || batchMemory
+			+ queries[last].truncations.size() * Inflater::stateSize
+			<= zlibBatchMemory))
 		{
-			bool invalid = validateCompressedResources(
-				img, info[p], bundle, resources);
+			batchMemory += queries[last].truncations.size()
+				* Inflater::stateSize;
+			++last;
+		}
 
-			if (invalid)
+		// Decode each resource once, keeping the state at every truncation
+		// point that is still valid
+		struct Prefix
+		{
+			int query;
+			int truncation; // Index in the query's truncation points
+			int remaining; // Size of the data to test after it
+			std::vector<int> anchors; // zlib headers relative to candidates
+			Inflater inflater;
+			uint64_t state; // The inflater's state, for the memo
+			std::atomic<uint64_t> match = UINT64_MAX;
+		};
+		std::vector<std::unique_ptr<Prefix>> prefixes;
+		for (int q = first; q < last; ++q)
+		{
+			const ZlibQuery& query = queries[q];
+			Inflater inflater;
+			inflater.reset(query.uncompressedSize);
+			for (int t = 0; t < query.truncations.size(); ++t)
 			{
-				// Get an estimate of the correct fragment size
-				info[p].sz.back() = getCompressedResourcesFailPos(
-					img, info[p], bundle, resources);
-				for (int i = 0; i < info[p].sz.size() - 1; ++i)
-					info[p].sz.back() -= info[p].sz[i];
-				searchedAll = false; // New resource
+				int corruptionOffset = query.truncations[t]
+					- query.resourceOffset;
+				if (!inflater.advance(query.resource.constData(),
+					corruptionOffset))
+					break;
+				int remaining = query.resource.size() - corruptionOffset;
+				std::vector<int> anchors;
+				for (int anchor : query.anchors)
+					anchors.push_back(anchor - query.truncations[t]);
+				prefixes.emplace_back(new Prefix{ q, t, remaining, anchors,
+					inflater, memoStates++ });
 			}
+		}
+
+		// Lowest truncation point with a match for each query. Later points
+		// are no longer tested once an earlier one matches.
+		std::vector<std::atomic<int>> matchedTruncation(last - first);
+		for (auto& truncation : matchedTruncation)
+			truncation = INT_MAX;
+
+		log("Searching whole image for " + QString::number(last - first)
+			+ " resources (" + QString::number(prefixes.size())
+			+ " truncation points)");
+
+		// Each executor thread streams its part of the image once, testing
+		// every sector against every outstanding prefix
+		int numThreads = executor.size();
+		uint64_t sectors = (endOffset - startOffset + interval - 1) / interval;
+		executor.run(numThreads,
+			[this, &prefixes, &matchedTruncation, first, numThreads,
+			sectors](int i, int)
+			{
+				uint64_t s = startOffset + sectors / numThreads * i * interval;
+				uint64_t e = startOffset
+					+ sectors / numThreads * (i + 1) * interval;
+				if (i == numThreads - 1)
+					e = endOffset;
+
+				std::vector<Bytef> scratch;
+				uint64_t lookups = 0;
+				uint64_t hits = 0;
+
+				for (uint64_t block = s; block < e;
+					block += zlibSweepBlockSize)
+				{
+					if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+						break;
+					if (((block - s) & 0xFFFFFFF) == 0)
+						log("Searching offset 0x"
+							+ QString::number(block, 16).toUpper());
+
+					// Read past the end of the block so candidates near its
+					// end can be probed. The rest of a candidate is only
+					// read once its probe passes. Each block is read once,
+					// so it isn't kept in the cache.
+					uint64_t blockEnd = std::min(block
+						+ zlibSweepBlockSize, e);
+					QByteArray data(blockEnd - block + zlibProbeSize,
+						Qt::Uninitialized);
+					data.truncate(std::max<int64_t>(imageCache.readUncached(
+						block, data.data(), data.size()), 0));
+
+					for (uint64_t j = block; j < blockEnd; j += interval)
+					{
+						if (claimedSectors.isClaimed(j))
+							continue;
+						int available = data.size() - (j - block);
+						if (available <= 0)
+							break;
+						SectorMap::Type type = sectorMap.get(j);
+						for (auto& prefix : prefixes)
+						{
+							if (prefix->truncation > matchedTruncation[
+								prefix->query - first]
+								|| j >= prefix->match
+								|| !sectorMap.mayStartFragment(type,
+								SectorMap::Content::Compressed,
+								prefix->remaining)
+								|| !hasZlibAnchors(j, prefix->anchors))
+								continue;
+							const char* continuation = data.constData()
+								+ (j - block);
+							int size = prefix->remaining;
+							if (size > zlibProbeSize
+								&& !testZlibCandidate(prefix->inflater,
+								continuation, std::min(zlibProbeSize,
+								available), true, prefix->state, scratch,
+								lookups, hits))
+								continue;
+							QByteArray rest;
+							if (size > available)
+							{
+								rest = QByteArray(size, Qt::Uninitialized);
+								rest.truncate(std::max<int64_t>(
+									imageCache.readUncached(j, rest.data(),
+									size), 0));
+								continuation = rest.constData();
+								size = rest.size();
+							}
+							if (!testZlibCandidate(prefix->inflater,
+								continuation, size, false, prefix->state,
+								scratch, lookups, hits))
+								continue;
+
+							// Keep the lowest match so results don't
+							// depend on thread timing
+							uint64_t lowest = prefix->match;
+							while (j < lowest && !prefix->match
+								.compare_exchange_weak(lowest, j));
+							int lowestTruncation = matchedTruncation[
+								prefix->query - first];
+							while (prefix->truncation < lowestTruncation
+								&& !matchedTruncation[prefix->query - first]
+								.compare_exchange_weak(lowestTruncation,
+								prefix->truncation));
+						}
+					}
+				}
 
-			log("T" + QString::number(threadId)
-				+ " Bundle at 0x" + QString::number(info[p].pos[0], 16).toUpper()
-				+ ": data fragment at 0x"
-				+ QString::number(info[p].pos.back(), 16).toUpper() + " for 0x"
-				+ QString::number(info[p].sz.back(), 16).toUpper());
+				continuationMemo.count(lookups, hits);
+			});
 
-			if (!invalid)
+		// The earliest truncation point wins, as in the search near the
+		// fragments
+		for (const auto& prefix : prefixes)
+		{
+			ZlibQuery& query = queries[prefix->query];
+			if (prefix->truncation
+				== matchedTruncation[prefix->query - first])
 			{
-				corrupt = CorruptionType::Intact;
-				log("T" + QString::number(threadId) + " Bundle at 0x"
-					+ QString::number(info[p].pos[0], 16).toUpper()
-					+ " is intact");
+				query.truncation = query.truncations[prefix->truncation];
+				query.match = prefix->match;
 			}
 		}
 
-		prevResource = resourceIndex;
-		prevChunk = chunkIndex;
+		first = last;
 	}
 }
+
+std::vector<int> BundleRecovery::applyZlibQueries(
+	const std::vector<ZlibQuery>& queries, std::vector<FileInfo>& info,
+	const std::vector<Bundle>& bundles,
+	const std::vector<std::vector<ResourceEntry>>& resources,
+	std::vector<CorruptionType>& corrupt, std::vector<BundleBuffer>& buffers)
+{
+	CachedImage image(imageCache);
+
+	std::vector<int> pending;
+	for (const ZlibQuery& query : queries)
+	{
+		int i = query.bundle;
+		info[i] = query.info;
+		if (query.match == UINT64_MAX)
+		{
+			log("Bundle at 0x" + QString::number(info[i].pos[0], 16).toUpper()
+				+ ": failed to defrag resources");
+
+			// Make end size the remainder of the bundle
+			info[i].sz.back() = query.intendedSize;
+			for (int k = 0; k < info[i].sz.size() - 1; ++k)
+				info[i].sz.back() -= info[i].sz[k];
+			recordDefrag(info[i], corrupt[i]);
+			buffers[i] = {};
+			continue;
+		}
+
+		BundleBuffer& buffer = buffers[i];
+		std::vector<bool> validResources;
+		applyZlibFragment(image, info[i], bundles[i], buffer, resources[i],
+			validResources, corrupt[i], query.truncation, query.match,
+			query.intendedSize, 0);
+
+		// Bundles with more corruption go through defragmentation again
+		if (corrupt[i] == CorruptionType::Intact)
+		{
+			claimFragments(info[i], info[i].pos.size());
+			recordDefrag(info[i], corrupt[i]);
+			buffer = {};
+
+			// Extracted now, as bundles defragmented in a queue are
+			if (ui.checkBoxExtract->isChecked())
+				extractBundles(info, corrupt, i, i + 1, 0);
+		}
+		else
+		{
+			claimFragments(info[i], info[i].pos.size() - 1);
+			pending.push_back(i);
+		}
+	}
+
+	image.close();
+
+	return pending;
+}
@@ -0,0 +1,180 @@
+#include "../Executor.h"
+
+#include <algorithm>
+
+// The executor whose thread this is, and its index, if any
+static thread_local const Executor* worker = nullptr;
+static thread_local int workerIndex = -1;
+
+Executor::~Executor()
+{
+	stop();
+}
+
+void Executor::start(int threadCount)
+{
+	stop();
+
+	stopping = false;
+	for (int i = 0; i < threadCount; ++i)
+		queues.push_back(std::make_unique<Queue>());
+	for (int i = 0; i < threadCount; ++i)
+	{
+		threads.push_back(QThread::create([this, i] { work(i); }));
+		threads[i]->start();
+	}
+}
+
+void Executor::stop()
+{
+	mutex.lock();
+	stopping = true;
+	tasksQueued.wakeAll();
+	mutex.unlock();
+
+	for (QThread* thread : threads)
+	{
+		thread->wait();
+		delete thread;
+	}
+	threads.clear();
+	queues.clear();
+}
+
+int Executor::size() const
+{
+	return threads.size();
+}
+
+void Executor::run(int count, const std::function<void(int, int)>& task)
+{
+	if (count <= 0)
+		return;
+
+	Batch batch{ &task, count };
+	bool nested = worker == this;
+
+	// Dealt out in turn, so every thread starts on the first tasks. Tasks run
+	// from a task start with its own thread.
+	int first = nested ? workerIndex : 0;
+	for (int i = 0; i < count; ++i)
+	{
+		Queue& queue = *queues[(first + i) % queues.size()];
+		QMutexLocker queueLocker(&queue.mutex);
+		queue.jobs.push_back({ &batch, i });
+		++queued;
+	}
+	mutex.lock();
+	tasksQueued.wakeAll();
+	mutex.unlock();
+
+	// The calling task can't finish until the new ones do, so its thread works
+	// on them rather than wait. Only on them, since other tasks could take
+	// much longer.
+	if (nested)
+	{
+		Job job;
+		while (takeFrom(batch, job))
+			finish(job, workerIndex);
+	}
+
+	QMutexLocker locker(&mutex);
+	while (batch.remaining != 0)
+		tasksDone.wait(&mutex);
+}
+
+void Executor::work(int thread)
+{
+	worker = this;
+	workerIndex = thread;
+
+	while (true)
+	{
+		mutex.lock();
+		while (queued == 0 && !stopping)
+			tasksQueued.wait(&mutex);
+		if (stopping)
+		{
+			mutex.unlock();
+			return;
+		}
+		mutex.unlock();
+
+		Job job;
+		while (take(thread, job))
+			finish(job, thread);
+	}
+}
+
+bool Executor::take(int thread, Job& job)
+{
+	Queue& own = *queues[thread];
+	own.mutex.lock();
+	if (!own.jobs.empty())
+	{
+		job = own.jobs.front();
+		own.jobs.pop_front();
+		own.mutex.unlock();
+		--queued;
+		return true;
+	}
+	own.mutex.unlock();
+
+	// Steal from whichever thread has the most left
+	while (true)
+	{
+		Queue* fullest = nullptr;
+		size_t most = 0;
+		for (auto& queue : queues)
+		{
+			QMutexLocker locker(&queue->mutex);
+			if (queue->jobs.size() > most)
+			{
+				fullest = queue.get();
+				most = queue->jobs.size();
+			}
+		}
+		if (!fullest)
+			return false;
+
+		QMutexLocker locker(&fullest->mutex);
+		if (fullest->jobs.empty())
+			continue; // Taken meanwhile
+		job = fullest->jobs.back();
+		fullest->jobs.pop_back();
+		--queued;
+		return true;
+	}
+}
+
+bool Executor::takeFrom(const Batch& batch, Job& job)
+{
+	for (auto& queue : queues)
+	{
+		QMutexLocker locker(&queue->mutex);
+		auto it = std::find_if(queue->jobs.begin(), queue->jobs.end(),
+			[&batch](const Job& queued) { return queued.batch == &batch; });
+		if (it != queue->jobs.end())
+		{
+			job = *it;
+			queue->jobs.erase(it);
+			--queued;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Executor::finish(const Job& job, int thread)
+{
+	(*job.batch->task)(job.index, thread);
+
+	// The batch is gone once its caller sees the last task finish, so it
+	// isn't touched after
+	if (--job.batch->remaining == 0)
+	{
+		mutex.lock();
+		tasksDone.wakeAll();
+		mutex.unlock();
+	}
+}
@@ -13,16 +13,15 @@ void BundleRecovery::extractBundles(const std::vector<FileInfo>& info,
 	const std::vector<CorruptionType>& corrupt, int start, int end,
 	int threadId)
 {
-	log("Thread " + QString::number(threadId)
-		+ " delegated bundles " + QString::number(start)
-		+ " to " + QString::number(end - 1));
-	uint64_t dateTimePre = QDateTime::currentSecsSinceEpoch();
-
-	QFile image(input);
-	image.open(QIODevice::ReadOnly);
+	CachedImage image(imageCache);
 
 	for (int i = start; i < end; ++i)
 	{
+		// Skip bundles extracted by a previous run
+		QString outPath = bundleName(info[i], corrupt[i]);
+		if (isExtracted(info[i], outPath))
+			continue;
+
 		QByteArray bundleData;
 		for (int j = 0; j < info[i].pos.size(); ++j)
 		{
@@ -30,7 +29,6 @@ void BundleRecovery::extractBundles(const std::vector<FileInfo>& info,
 			bundleData.append(image.read(info[i].sz[j]));
 		}
 
-		QString outPath = bundleName(info[i], corrupt[i]);
 		QFile out(outPath);
 		out.open(QIODevice::WriteOnly);
 		QDataStream outStream(&out);
@@ -38,12 +36,10 @@ void BundleRecovery::extractBundles(const std::vector<FileInfo>& info,
 		out.close();
 		QFileInfo outInfo(out);
 		log("Extracted " + outInfo.fileName());
+		recordExtracted(info[i], outPath);
 	}
 
 	image.close();
-	uint64_t timeTaken = QDateTime::currentSecsSinceEpoch() - dateTimePre;
-	log("Thread " + QString::number(threadId)
-		+ " finished in " + QString::number(timeTaken) + " seconds");
 }
 
 QString BundleRecovery::bundleName(const FileInfo& info, CorruptionType corrupt)
@@ -7,34 +7,62 @@
 
 void BundleRecovery::findBundles(std::vector<FileInfo>& info,
 	std::vector<Bundle>& bundles, uint64_t start, uint64_t end,
-	int threadId)
+	int64_t acquired, int threadId)
 {
-	log("Thread " + QString::number(threadId)
-		+ " delegated 0x" + QString::number(start, 16).toUpper()
-		+ " to 0x" + QString::number(end - 1, 16).toUpper());
-	uint64_t dateTimePre = QDateTime::currentSecsSinceEpoch();
-
 	QFile image(input);
 	image.open(QIODevice::ReadOnly);
+	Prefetcher::advise(image, start, end - start,
+		Prefetcher::Access::Sequential);
 	image.seek(start);
 
+	// Ranges scanned by a previous run are skipped
+	std::vector<std::pair<uint64_t, uint64_t>> scanned = getScannedRanges();
+	auto skip = scanned.begin();
+
+	// Threads take turns reading, as many at once as the disk handles best
+	uint64_t turnStart = image.pos();
+
 	while (image.pos() < end)
 	{
 		// Cancel pressed
 		if (!ui.pushButtonStop->isEnabled())
 		{
+			ioThreads.release(acquired, image.pos() - turnStart);
+			recordScanned(start, image.pos());
 			image.close();
 			return;
 		}
+		if (image.pos() - turnStart >= scanTurnSize)
+		{
+			ioThreads.release(acquired, image.pos() - turnStart);
+			acquired = ioThreads.acquire();
+			turnStart = image.pos();
+		}
 
 		image.seek(binaryio::Align((uint64_t)image.pos(), interval));
 		uint64_t offset = image.pos();
+		while (skip != scanned.end() && skip->second <= offset)
+			++skip;
+		if (skip != scanned.end() && skip->first <= offset)
+		{
+			turnStart += skip->second - offset; // Not read
+			image.seek(skip->second);
+			continue;
+		}
 		if ((offset & 0xFFFFFFF) == 0)
 		{
 			log("Scanning offset 0x" + QString::number(offset, 16).toUpper());
+			recordScanned(start, offset);
 		}
+
+		// Classify the sector for the Defragmenter, then check for a bundle
+		QByteArray sector = image.read(interval);
+		sectorMap.set(offset, SectorMap::classify(sector.constData(),
+			sector.size()), SectorMap::containsZlibHeader(sector.constData(),
+			sector.size()));
 		char magic[4] = {};
-		image.read(magic, 4);
+		memcpy(magic, sector.constData(), std::min<int>(sector.size(), 4));
+		image.seek(offset + 4);
 		if (!strncmp(magic, "bndl", 4))
 		{
 			// Verify validity via version number
@@ -55,6 +83,7 @@ void BundleRecovery::findBundles(std::vector<FileInfo>& info,
 				bundles.push_back({});
 				strncpy(bundles.back().magic, "bndl", 4);
 				bundles.back().version = version;
+				recordFound(offset, bundles.back());
 				mutex.unlock();
 				log("Found file at 0x"
 					+ QString::number(offset, 16).toUpper()
@@ -100,17 +129,17 @@ void BundleRecovery::findBundles(std::vector<FileInfo>& info,
 				bundles.push_back({});
 				strncpy(bundles.back().magic, "bnd2", 4);
 				bundles.back().version = version;
+				recordFound(offset, bundles.back());
 				mutex.unlock();
 				log("Found file at 0x" + QString::number(offset, 16).toUpper()
 					+ ", Bundle 2 v" + QString::number(version));
 			}
 		}
 	}
+	ioThreads.release(acquired, image.pos() - turnStart);
 
+	recordScanned(start, end);
 	image.close();
-	uint64_t timeTaken = QDateTime::currentSecsSinceEpoch() - dateTimePre;
-	log("Thread " + QString::number(threadId)
-		+ " finished in " + QString::number(timeTaken) + " seconds");
 }
 
 void BundleRecovery::sortBundles(std::vector<FileInfo>& info,
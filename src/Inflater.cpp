@@ -0,0 +1,125 @@
+#include "../Inflater.h"
+
+Inflater::Inflater()
+{
+	initialized = inflateInit(&base) == Z_OK;
+}
+
+Inflater::Inflater(const Inflater& other)
+	: valid(other.valid), ended(other.ended), consumed(other.consumed),
+	uncompressedSize(other.uncompressedSize)
+{
+	// The scratch output is not copied, it is resized when first used
+	initialized = inflateCopy(&base, const_cast<z_stream*>(&other.base))
+		== Z_OK;
+	valid = valid && initialized;
+}
+
+Inflater::~Inflater()
+{
+	if (initialized)
+		inflateEnd(&base);
+}
+
+void Inflater::reset(int uncompressedSize)
+{
+	if (initialized)
+		inflateReset(&base);
+	this->uncompressedSize = uncompressedSize;
+	output.resize(uncompressedSize);
+	valid = initialized;
+	ended = false;
+	consumed = 0;
+}
+
+bool Inflater::advance(const char* data, int size)
+{
+	// Moving backwards means decoding from the start again
+	if (size < consumed)
+		reset(uncompressedSize);
+
+	if (!valid || ended || size == consumed)
+		return valid;
+
+	// Decoded data is only needed in the window, so the output can be
+	// overwritten every call
+	base.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data))
+		+ consumed;
+	base.avail_in = size - consumed;
+	output.resize(uncompressedSize);
+	base.next_out = output.data();
+	base.avail_out = uncompressedSize - base.total_out;
+	int result = inflate(&base, Z_NO_FLUSH);
+	consumed = size;
+
+	if (result == Z_STREAM_END)
+	{
+		// Anything after the end of the stream is ignored
+		ended = true;
+		valid = base.total_out == (uLong)uncompressedSize;
+	}
+	else if (result != Z_OK && result != Z_BUF_ERROR)
+		valid = false;
+	else if (base.avail_out == 0 && base.avail_in != 0)
+		valid = false; // Inflates to more than the uncompressed size
+
+	return valid;
+}
+
+bool Inflater::test(const char* continuation, int size)
+{
+	return test(continuation, size, output);
+}
+
+bool Inflater::test(const char* continuation, int size,
+	std::vector<Bytef>& scratch) const
+{
+	if (!valid || ended)
+		return valid;
+
+	// The saved state is only read from
+	z_stream stream;
+	if (inflateCopy(&stream, const_cast<z_stream*>(&base)) != Z_OK)
+		return false;
+
+	scratch.resize(uncompressedSize);
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(continuation));
+	stream.avail_in = size;
+	stream.next_out = scratch.data();
+	stream.avail_out = uncompressedSize - base.total_out;
+	int result = inflate(&stream, Z_FINISH);
+	bool success = result == Z_STREAM_END && stream.avail_out == 0;
+	inflateEnd(&stream);
+
+	return success;
+}
+
+bool Inflater::probe(const char* continuation, int size,
+	std::vector<Bytef>& scratch) const
+{
+	if (!valid || ended)
+		return valid;
+
+	z_stream stream;
+	if (inflateCopy(&stream, const_cast<z_stream*>(&base)) != Z_OK)
+		return false;
+
+	// Only the output of this much input is needed, but the window must
+	// still fit whatever it decodes to
+	scratch.resize(uncompressedSize);
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(continuation));
+	stream.avail_in = size;
+	stream.next_out = scratch.data();
+	stream.avail_out = uncompressedSize - base.total_out;
+	int result = inflate(&stream, Z_NO_FLUSH);
+	bool possible;
+	if (result == Z_STREAM_END)
+		possible = stream.avail_out == 0;
+	else if (result == Z_OK || result == Z_BUF_ERROR)
+		possible = stream.avail_out != 0 || stream.avail_in == 0;
+	else
+		possible = false;
+	inflateEnd(&stream);
+
+	return possible;
+}
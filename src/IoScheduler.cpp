@@ -0,0 +1,211 @@
+#include "../IoScheduler.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <QFile>
+#include <QStorageInfo>
+
+#if defined(Q_OS_WIN)
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(Q_OS_LINUX)
+#include <sys/sysmacros.h>
+#endif
+
+IoScheduler::~IoScheduler()
+{
+	stop();
+}
+
+void IoScheduler::start(intptr_t handle, int queueDepth,
+	ConcurrencyController* controller)
+{
+	stop();
+
+	this->handle = handle;
+	this->queueDepth = queueDepth;
+	this->controller = controller;
+	head = 0;
+	stopping = false;
+	if (queueDepth != 0)
+	{
+		thread = QThread::create([this] { run(); });
+		thread->start();
+	}
+}
+
+void IoScheduler::stop()
+{
+	if (thread)
+	{
+		mutex.lock();
+		stopping = true;
+		queued.wakeAll();
+		mutex.unlock();
+
+		thread->wait();
+		delete thread;
+		thread = nullptr;
+	}
+	handle = -1;
+	queueDepth = 0;
+	controller = nullptr;
+}
+
+bool IoScheduler::isScheduled() const
+{
+	return queueDepth != 0;
+}
+
+int64_t IoScheduler::read(uint64_t offset, char* data, int64_t size)
+{
+	if (queueDepth == 0 && !controller)
+		return readAt(offset, data, size);
+	if (queueDepth == 0)
+	{
+		ConcurrencyController::Permit permit(*controller, size);
+		return readAt(offset, data, size);
+	}
+
+	// Wait for the read to be served in its sweep
+	Request request = { offset, data, size, -1, false };
+	QMutexLocker locker(&mutex);
+	if (stopping)
+		return -1;
+	requests.insert({ offset, &request });
+	queued.wakeOne();
+	while (!request.done)
+		served.wait(&mutex);
+
+	return request.result;
+}
+
+bool IoScheduler::isRotational(const QString& path)
+{
+#if defined(Q_OS_WIN)
+	// Ask the drive if the image is one, otherwise its volume
+	QString device = path;
+	if (!device.startsWith("\\\\.\\"))
+	{
+		device = QString::fromLatin1(QStorageInfo(path).device());
+		if (device.endsWith("\\"))
+			device.chop(1);
+	}
+	HANDLE volume = CreateFileW(reinterpret_cast<LPCWSTR>(device.utf16()), 0,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0,
+		nullptr);
+	if (volume == INVALID_HANDLE_VALUE)
+		return false;
+
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId = StorageDeviceSeekPenaltyProperty;
+	query.QueryType = PropertyStandardQuery;
+	DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {};
+	DWORD returned = 0;
+	bool queried = DeviceIoControl(volume, IOCTL_STORAGE_QUERY_PROPERTY,
+		&query, sizeof(query), &penalty, sizeof(penalty), &returned, nullptr);
+	CloseHandle(volume);
+
+	return queried && penalty.IncursSeekPenalty;
+#elif defined(Q_OS_LINUX)
+	// Images on a disk belong to its filesystem's device, images of a disk
+	// are the device
+	struct stat info;
+	if (stat(QFile::encodeName(path).constData(), &info) != 0)
+		return false;
+	dev_t device = S_ISBLK(info.st_mode) ? info.st_rdev : info.st_dev;
+
+	// Partitions use the queue of their disk
+	QString sysfs = "/sys/dev/block/" + QString::number(major(device)) + ":"
+		+ QString::number(minor(device));
+	for (const QString& queue : { sysfs + "/queue/rotational",
+		sysfs + "/../queue/rotational" })
+	{
+		QFile rotational(queue);
+		if (rotational.open(QIODevice::ReadOnly))
+			return rotational.readAll().trimmed() == "1";
+	}
+
+	return false;
+#else
+	return false;
+#endif
+}
+
+int64_t IoScheduler::readAt(uint64_t offset, char* data, int64_t size)
+{
+	int64_t done = 0;
+	while (done < size)
+	{
+		// Capped to what one call can read on every platform
+		uint32_t length = std::min<int64_t>(size - done, 0x40000000);
+		uint64_t position = offset + done;
+#ifdef Q_OS_WIN
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(position);
+		overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+		DWORD read = 0;
+		if (!ReadFile(reinterpret_cast<HANDLE>(handle), data + done, length,
+			&read, &overlapped) && GetLastError() != ERROR_HANDLE_EOF)
+			return done != 0 ? done : -1;
+#else
+		ssize_t read = pread(handle, data + done, length, position);
+		if (read < 0 && errno == EINTR)
+			continue;
+		if (read < 0)
+			return done != 0 ? done : -1;
+#endif
+		if (read == 0)
+			break; // End of file
+		done += read;
+	}
+
+	return done;
+}
+
+void IoScheduler::run()
+{
+	QMutexLocker locker(&mutex);
+	while (true)
+	{
+		while (requests.empty() && !stopping)
+			queued.wait(&mutex);
+		if (requests.empty())
+			return; // Stopping, with every read served
+
+		// Take the next reads past the head, starting over from the lowest
+		// offset once there are none
+		std::vector<Request*> sweep;
+		auto next = requests.lower_bound(head);
+		if (next == requests.end())
+			next = requests.begin();
+		while (next != requests.end() && sweep.size() < queueDepth)
+		{
+			sweep.push_back(next->second);
+			next = requests.erase(next);
+		}
+
+		// Reads queued meanwhile wait for the next sweep
+		for (Request* request : sweep)
+		{
+			locker.unlock();
+			int64_t started = ConcurrencyController::now();
+			int64_t result = readAt(request->offset, request->data,
+				request->size);
+			if (controller)
+				controller->record(started, std::max<int64_t>(result, 0));
+			locker.relock();
+
+			head = request->offset + std::max<int64_t>(result, 0);
+			request->result = result;
+			request->done = true;
+			served.wakeAll();
+		}
+	}
+}
@@ -0,0 +1,329 @@
+#include "../Journal.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <QSaveFile>
+
+static constexpr char journalMagic[4] = { 'B', 'R', 'J', 'L' };
+static constexpr char indexMagic[4] = { 'B', 'R', 'J', 'I' };
+static constexpr uint32_t journalVersion = 1;
+
+Journal::~Journal()
+{
+	close();
+}
+
+bool Journal::open(const QString& path, uint32_t imageHash)
+{
+	close();
+	QMutexLocker locker(&mutex);
+
+	file.setFileName(path);
+	indexPath = path + ".index";
+	if (!file.open(QIODevice::ReadWrite))
+		return false;
+
+	// Start over if the journal belongs to another image or format version
+	Header header = {};
+	bool valid = file.read(reinterpret_cast<char*>(&header), sizeof(Header))
+		== sizeof(Header)
+		&& !memcmp(header.magic, journalMagic, 4)
+		&& header.version == journalVersion
+		&& header.imageHash == imageHash;
+	if (!valid)
+	{
+		file.resize(0);
+		QFile::remove(indexPath);
+		header = {};
+		memcpy(header.magic, journalMagic, 4);
+		header.version = journalVersion;
+		header.imageHash = imageHash;
+		file.seek(0);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+		file.flush();
+	}
+
+	// Drop a record that was only partially written before a crash
+	count = (file.size() - sizeof(Header)) / sizeof(Record);
+
+	// Likewise a defragmentation result missing some of its fragments
+	int64_t block = count;
+	Record record = {};
+	do
+	{
+		if (block == 0)
+			break;
+		--block;
+		file.seek(sizeof(Header) + block * sizeof(Record));
+		file.read(reinterpret_cast<char*>(&record), sizeof(Record));
+	} while (record.type == RecordType::Fragment && count - block <= 0xFFFF);
+	if (record.type == RecordType::Defragged && block + record.count >= count)
+		count = block;
+
+	file.resize(sizeof(Header) + count * sizeof(Record));
+
+	map();
+
+	return true;
+}
+
+bool Journal::openReadOnly(const QString& path)
+{
+	close();
+	QMutexLocker locker(&mutex);
+
+	file.setFileName(path);
+	indexPath = path + ".index";
+	if (!file.open(QIODevice::ReadOnly))
+		return false;
+
+	Header header = {};
+	if (file.read(reinterpret_cast<char*>(&header), sizeof(Header))
+		!= sizeof(Header) || memcmp(header.magic, journalMagic, 4)
+		|| header.version != journalVersion)
+	{
+		file.close();
+		return false;
+	}
+	count = (file.size() - sizeof(Header)) / sizeof(Record);
+
+	map();
+
+	return true;
+}
+
+void Journal::close()
+{
+	QMutexLocker locker(&mutex);
+
+	unmap();
+	if (file.isOpen())
+		file.close();
+	count = 0;
+	recent.clear();
+}
+
+void Journal::append(const Record* records, int count)
+{
+	QMutexLocker locker(&mutex);
+
+	file.seek(sizeof(Header) + this->count * sizeof(Record));
+	file.write(reinterpret_cast<const char*>(records), count * sizeof(Record));
+	file.flush();
+
+	for (int i = 0; i < count; ++i)
+		addEntry(recent, this->count + i, records[i]);
+	this->count += count;
+}
+
+int64_t Journal::size()
+{
+	QMutexLocker locker(&mutex);
+	return count;
+}
+
+Journal::Record Journal::at(int64_t index)
+{
+	QMutexLocker locker(&mutex);
+	Record record = {};
+
+	// Indexed records are read straight from the mapped journal, which
+	// buildIndex remaps under the lock
+	if (index < indexedCount)
+	{
+		memcpy(&record, mappedRecords + sizeof(Header) + index * sizeof(Record),
+			sizeof(Record));
+		return record;
+	}
+
+	file.seek(sizeof(Header) + index * sizeof(Record));
+	file.read(reinterpret_cast<char*>(&record), sizeof(Record));
+
+	return record;
+}
+
+bool Journal::find(uint64_t offset, RecordType type, int64_t& index)
+{
+	int slot = indexSlot(type);
+	if (slot < 0)
+		return false;
+
+	QMutexLocker locker(&mutex);
+
+	// Records newer than the index take precedence
+	const auto& recentEntry = recent.find(offset);
+	if (recentEntry != recent.end()
+		&& recentEntry->second.records[slot] != noRecord)
+	{
+		index = recentEntry->second.records[slot];
+		return true;
+	}
+
+	if (!mappedIndex)
+		return false;
+	const IndexEntry* begin = reinterpret_cast<const IndexEntry*>(
+		mappedIndex + sizeof(IndexHeader));
+	const IndexEntry* end = begin + indexEntries;
+	const IndexEntry* entry = std::lower_bound(begin, end, offset,
+		[](const IndexEntry& a, uint64_t b)
+		{
+			return a.offset < b;
+		});
+	if (entry == end || entry->offset != offset
+		|| entry->records[slot] == noRecord)
+		return false;
+
+	index = entry->records[slot];
+	return true;
+}
+
+void Journal::forEach(
+	const std::function<void(int64_t, const Record&)>& function)
+{
+	QMutexLocker locker(&mutex);
+	read(function);
+}
+
+void Journal::buildIndex()
+{
+	QMutexLocker locker(&mutex);
+
+	if (!(file.openMode() & QIODevice::WriteOnly))
+		return;
+
+	// Latest records for each bundle, sorted by bundle offset
+	std::unordered_map<uint64_t, IndexEntry> latest;
+	read([&latest](int64_t index, const Record& record)
+		{
+			addEntry(latest, index, record);
+		});
+	std::vector<IndexEntry> entries;
+	entries.reserve(latest.size());
+	for (const auto& entry : latest)
+		entries.push_back(entry.second);
+	latest.clear();
+	std::sort(entries.begin(), entries.end(),
+		[](const IndexEntry& a, const IndexEntry& b)
+		{
+			return a.offset < b.offset;
+		});
+
+	// The index can't be replaced while it is mapped
+	unmap();
+
+	QSaveFile save(indexPath);
+	if (save.open(QIODevice::WriteOnly))
+	{
+		IndexHeader header = {};
+		memcpy(header.magic, indexMagic, 4);
+		header.recordCount = count;
+		save.write(reinterpret_cast<const char*>(&header), sizeof(IndexHeader));
+		save.write(reinterpret_cast<const char*>(entries.data()),
+			entries.size() * sizeof(IndexEntry));
+		save.commit();
+	}
+
+	map();
+}
+
+int Journal::indexSlot(RecordType type)
+{
+	switch (type)
+	{
+	case RecordType::Validated:
+		return 0;
+	case RecordType::Defragged:
+		return 1;
+	case RecordType::Extracted:
+		return 2;
+	default:
+		return -1;
+	}
+}
+
+void Journal::addEntry(std::unordered_map<uint64_t, IndexEntry>& entries,
+	int64_t index, const Record& record)
+{
+	int slot = indexSlot(record.type);
+	if (slot < 0)
+		return;
+
+	IndexEntry& entry = entries.try_emplace(record.offset,
+		IndexEntry{ record.offset, { noRecord, noRecord, noRecord }, 0 })
+		.first->second;
+	entry.records[slot] = index;
+}
+
+void Journal::read(const std::function<void(int64_t, const Record&)>& function)
+{
+	std::vector<Record> records(0x10000);
+	file.seek(sizeof(Header));
+	for (int64_t i = 0; i < count; i += records.size())
+	{
+		int64_t toRead = std::min<int64_t>(records.size(), count - i);
+		file.read(reinterpret_cast<char*>(records.data()),
+			toRead * sizeof(Record));
+		for (int64_t j = 0; j < toRead; ++j)
+			function(i + j, records[j]);
+	}
+}
+
+void Journal::map()
+{
+	unmap();
+
+	indexFile.setFileName(indexPath);
+	if (indexFile.open(QIODevice::ReadOnly))
+	{
+		IndexHeader header = {};
+		qint64 entriesSize = indexFile.size() - sizeof(IndexHeader);
+		if (indexFile.read(reinterpret_cast<char*>(&header),
+			sizeof(IndexHeader)) == sizeof(IndexHeader)
+			&& !memcmp(header.magic, indexMagic, 4)
+			&& (int64_t)header.recordCount <= count
+			&& entriesSize % sizeof(IndexEntry) == 0)
+		{
+			mappedIndex = indexFile.map(0, indexFile.size());
+			mappedRecords = file.map(0,
+				sizeof(Header) + header.recordCount * sizeof(Record));
+			if (mappedIndex && mappedRecords)
+			{
+				indexedCount = header.recordCount;
+				indexEntries = entriesSize / sizeof(IndexEntry);
+			}
+			else
+				unmap();
+		}
+		else
+			indexFile.close();
+	}
+
+	// Records after the end of the index are looked up in memory
+	recent.clear();
+	std::vector<Record> records(0x10000);
+	file.seek(sizeof(Header) + indexedCount * sizeof(Record));
+	for (int64_t i = indexedCount; i < count; i += records.size())
+	{
+		int64_t toRead = std::min<int64_t>(records.size(), count - i);
+		file.read(reinterpret_cast<char*>(records.data()),
+			toRead * sizeof(Record));
+		for (int64_t j = 0; j < toRead; ++j)
+			addEntry(recent, i + j, records[j]);
+	}
+}
+
+void Journal::unmap()
+{
+	if (mappedRecords)
+		file.unmap(mappedRecords);
+	if (mappedIndex)
+		indexFile.unmap(mappedIndex);
+	if (indexFile.isOpen())
+		indexFile.close();
+	mappedRecords = nullptr;
+	mappedIndex = nullptr;
+	indexedCount = 0;
+	indexEntries = 0;
+}
@@ -0,0 +1,163 @@
+#include "../BundleRecovery.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+
+void BundleRecovery::streamBundles(std::vector<BundleBatch>& batches,
+	uint64_t imgSize)
+{
+	BoundedQueue<FoundBundle> found(pipelineQueueSize);
+	int chunkCount = batches.size();
+	std::atomic<int> nextChunk = 0;
+	std::atomic<int> scannedChunks = 0;
+
+	// Every thread scans chunks until there are none left, then works on the
+	// bundles still queued. Bundles already found go first, so they aren't
+	// held up by the scan.
+	executor.run(executor.size(),
+		[this, &batches, imgSize, &found, chunkCount, &nextChunk,
+		&scannedChunks](int, int thread)
+		{
+			FoundBundle bundle;
+			while (ui.pushButtonStop->isEnabled())
+			{
+				if (found.tryPop(bundle))
+				{
+					recoverBundle(found, bundle, thread);
+					continue;
+				}
+
+				if (nextChunk < chunkCount)
+				{
+					// Threads only wait to read the image when there are no
+					// bundles to work on meanwhile
+					int64_t acquired;
+					if (!ioThreads.tryAcquire(acquired))
+					{
+						if (found.tryPop(bundle))
+						{
+							recoverBundle(found, bundle, thread);
+							continue;
+						}
+						acquired = ioThreads.acquire();
+					}
+
+					int chunk = nextChunk++;
+					if (chunk < chunkCount)
+					{
+						uint64_t s = chunk * scanChunkSize;
+						uint64_t e = std::min(s + scanChunkSize, imgSize);
+						scanChunk(batches[chunk], s, e, acquired, found,
+							thread);
+						if (++scannedChunks == chunkCount)
+							found.close();
+						continue;
+					}
+					ioThreads.release();
+				}
+
+				if (!found.pop(bundle))
+					return; // Every bundle has been worked on
+				recoverBundle(found, bundle, thread);
+			}
+
+			// Cancel pressed, so wake the threads waiting for bundles
+			found.close();
+		});
+}
+
+void BundleRecovery::scanChunk(BundleBatch& batch, uint64_t start,
+	uint64_t end, int64_t acquired, BoundedQueue<FoundBundle>& found,
+	int threadId)
+{
+	// Bundles found by a previous run are passed on with the rest
+	resumeFound(batch.info, batch.bundles, start, end);
+	findBundles(batch.info, batch.bundles, start, end, acquired, threadId);
+	sortBundles(batch.info, batch.bundles);
+
+	int count = batch.info.size();
+	batch.debugData.resize(count);
+	batch.resources.resize(count);
+	batch.imports.resize(count);
+	batch.corrupt.resize(count);
+	batch.hashes.resize(count);
+	batch.buffers.resize(count);
+
+	for (int i = 0; i < count; ++i)
+	{
+		// A full queue means the other threads are behind, so this one helps
+		// them instead of scanning further ahead
+		if (!found.tryPush({ &batch, i }))
+			recoverFound({ &batch, i }, threadId);
+	}
+}
+
+void BundleRecovery::recoverBundle(BoundedQueue<FoundBundle>& found,
+	const FoundBundle& bundle, int threadId)
+{
+	// The next bundle is read while this one is worked on
+	FoundBundle next;
+	if (found.tryPeek(next))
+		prefetcher.prefetch(next.batch->info[next.index].pos[0],
+			BlockCache::blockSize);
+
+	recoverFound(bundle, threadId);
+}
+
+void BundleRecovery::recoverFound(const FoundBundle& found, int threadId)
+{
+	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+		return;
+
+	BundleBatch& batch = *found.batch;
+	int i = found.index;
+	readBundles(batch.info, batch.bundles, batch.debugData, batch.resources,
+		i, i + 1, threadId);
+
+	// Intact bundles are validated in whole, so their data is read while
+	// the metadata is checked
+	prefetcher.prefetch(batch.info[i].pos[0], std::min<uint64_t>(
+		std::max(GetBundleSize(batch.bundles[i], batch.resources[i]), 0),
+		prefetchWindowSize));
+	validateBundles(batch.info, batch.bundles, batch.debugData,
+		batch.resources, batch.imports, batch.corrupt, batch.hashes,
+		batch.buffers, i, i + 1, threadId);
+	if (!ui.checkBoxDefrag->isChecked())
+		batch.buffers[i] = {};
+	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
+		return;
+
+	// Corrupt bundles wait for the Defragmenter, which can only start once
+	// the whole image has been scanned
+	bool intact = batch.corrupt[i] == CorruptionType::Intact
+		|| batch.corrupt[i] == CorruptionType::Uncompressed;
+	if (ui.checkBoxExtract->isChecked()
+		&& (intact || !ui.checkBoxDefrag->isChecked()))
+		extractBundles(batch.info, batch.corrupt, i, i + 1, threadId);
+}
+
+void BundleRecovery::mergeBatches(std::vector<BundleBatch>& batches,
+	std::vector<FileInfo>& info, std::vector<Bundle>& bundles,
+	std::vector<QByteArray>& debugData,
+	std::vector<std::vector<ResourceEntry>>& resources,
+	std::vector<CorruptionType>& corrupt, std::vector<BundleBuffer>& buffers)
+{
+	auto append = [](auto& to, auto& from)
+		{
+			to.insert(to.end(), std::make_move_iterator(from.begin()),
+				std::make_move_iterator(from.end()));
+		};
+
+	// Chunks are in order of offset, and so are the bundles found in each
+	for (BundleBatch& batch : batches)
+	{
+		append(info, batch.info);
+		append(bundles, batch.bundles);
+		append(debugData, batch.debugData);
+		append(resources, batch.resources);
+		append(corrupt, batch.corrupt);
+		append(buffers, batch.buffers);
+	}
+	batches.clear();
+}
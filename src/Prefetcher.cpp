@@ -0,0 +1,121 @@
+#include "../Prefetcher.h"
+
+#include <algorithm>
+#include <climits>
+
+#if defined(Q_OS_LINUX) || defined(Q_OS_MACOS)
+#include <fcntl.h>
+#endif
+
+// Data read into the cache between checks for new or dropped ranges
+static constexpr uint64_t prefetchStep = 0x100000;
+
+Prefetcher::~Prefetcher()
+{
+	stop();
+}
+
+void Prefetcher::start(BlockCache& cache)
+{
+	stop();
+
+	this->cache = &cache;
+	stopping = false;
+	thread = QThread::create([this] { run(); });
+	thread->start();
+}
+
+void Prefetcher::stop()
+{
+	if (!thread)
+		return;
+
+	mutex.lock();
+	stopping = true;
+	ranges.clear();
+	queued = 0;
+	queuedRange.wakeAll();
+	mutex.unlock();
+
+	thread->wait();
+	delete thread;
+	thread = nullptr;
+	cache = nullptr;
+}
+
+void Prefetcher::prefetch(uint64_t offset, uint64_t size)
+{
+	if (size == 0)
+		return;
+	size = std::min(size, maxQueued);
+
+	QMutexLocker locker(&mutex);
+	if (!thread || stopping)
+		return;
+
+	// The OS can start reading before the thread gets to the range
+	advise(cache->source(), offset, size, Access::WillNeed);
+
+	// Threads move on quickly, so ranges queued long ago are dropped first
+	ranges.push_back({ offset, size });
+	queued += size;
+	while (queued > maxQueued)
+	{
+		queued -= ranges.front().second;
+		ranges.pop_front();
+	}
+	queuedRange.wakeOne();
+}
+
+void Prefetcher::advise(const QFileDevice& file, uint64_t offset,
+	uint64_t size, Access access)
+{
+#if defined(Q_OS_LINUX)
+	int advice = POSIX_FADV_NORMAL;
+	if (access == Access::Sequential)
+		advice = POSIX_FADV_SEQUENTIAL;
+	else if (access == Access::Random)
+		advice = POSIX_FADV_RANDOM;
+	else if (access == Access::WillNeed)
+		advice = POSIX_FADV_WILLNEED;
+	posix_fadvise(file.handle(), offset, size, advice);
+#elif defined(Q_OS_MACOS)
+	// Only reading ahead has an equivalent
+	if (access == Access::WillNeed)
+	{
+		radvisory advisory;
+		advisory.ra_offset = offset;
+		advisory.ra_count = std::min<uint64_t>(size, INT_MAX);
+		fcntl(file.handle(), F_RDADVISE, &advisory);
+	}
+#endif
+}
+
+void Prefetcher::run()
+{
+	while (true)
+	{
+		mutex.lock();
+		while (ranges.empty() && !stopping)
+			queuedRange.wait(&mutex);
+		if (stopping)
+		{
+			mutex.unlock();
+			return;
+		}
+
+		// Take a step of the newest range, leaving the rest queued. Threads
+		// which queued older ranges have likely moved on from them, and
+		// loading them anyway would evict blocks still in use.
+		uint64_t offset = ranges.back().first;
+		uint64_t size = std::min(ranges.back().second, prefetchStep);
+		ranges.back().first += size;
+		ranges.back().second -= size;
+		queued -= size;
+		if (ranges.back().second == 0)
+			ranges.pop_back();
+		mutex.unlock();
+
+		cache->load(offset, size);
+	}
+}
@@ -1,22 +1,18 @@
 #include "../BundleRecovery.h"
 
+#include <algorithm>
+
 #include <binaryio/binaryreader.hpp>
 
 #include <QDataStream>
 #include <QtEndian>
 
 void BundleRecovery::readBundles(std::vector<FileInfo>& info,
-	std::vector<Bundle>& bundles, std::vector<QString>& debugData,
+	std::vector<Bundle>& bundles, std::vector<QByteArray>& debugData,
 	std::vector<std::vector<ResourceEntry>>& resources,
 	int start, int end, int threadId)
 {
-	log("Thread " + QString::number(threadId)
-		+ " delegated bundles " + QString::number(start)
-		+ " to " + QString::number(end - 1));
-	uint64_t dateTimePre = QDateTime::currentSecsSinceEpoch();
-
-	QFile image(input);
-	image.open(QIODevice::ReadOnly);
+	CachedImage image(imageCache);
 
 	for (int i = start; i < end; ++i)
 	{
@@ -38,12 +34,65 @@ void BundleRecovery::readBundles(std::vector<FileInfo>& info,
 	}
 
 	image.close();
-	uint64_t timeTaken = QDateTime::currentSecsSinceEpoch() - dateTimePre;
-	log("Thread " + QString::number(threadId)
-		+ " finished in " + QString::number(timeTaken) + " seconds");
 }
 
-void BundleRecovery::readHeaders(QFile& img, const FileInfo& info,
+void BundleRecovery::readBundleData(QIODevice& img, const FileInfo& info,
+	BundleBuffer& buffer, int size)
+{
+	// Keep the data of every leading fragment that is unchanged
+	int kept = 0;
+	qsizetype keptSize = 0;
+	while (kept < info.pos.size() && kept < buffer.read.pos.size()
+		&& info.pos[kept] == buffer.read.pos[kept]
+		&& info.sz[kept] == buffer.read.sz[kept])
+	{
+		keptSize += info.sz[kept];
+		++kept;
+	}
+
+	// A fragment that still starts at the same position only needs the part
+	// of it which has not been read yet. Data read past the end of the last
+	// fragment, such as by validation before it was cut short, is kept if it
+	// is asked for again.
+	uint32_t reused = 0;
+	if (kept < info.pos.size() && kept < buffer.read.pos.size()
+		&& info.pos[kept] == buffer.read.pos[kept])
+	{
+		qsizetype wanted = info.sz[kept];
+		if (kept == info.pos.size() - 1)
+			wanted = std::max<qsizetype>(wanted, size - keptSize);
+		reused = std::min<qsizetype>(wanted, buffer.read.sz[kept]);
+	}
+
+	buffer.data.truncate(keptSize + reused);
+	buffer.read.pos.resize(kept);
+	buffer.read.sz.resize(kept);
+
+	for (int i = kept; i < info.pos.size(); ++i)
+	{
+		uint32_t offset = (i == kept) ? reused : 0;
+		QByteArray fragment;
+		if (offset < info.sz[i])
+		{
+			img.seek(info.pos[i] + offset);
+			fragment = img.read(info.sz[i] - offset);
+		}
+		buffer.data.append(fragment);
+		buffer.read.pos.push_back(info.pos[i]);
+		buffer.read.sz.push_back(offset + fragment.size());
+	}
+
+	// Continue reading from the end of the last fragment
+	if (size > buffer.data.size() && !buffer.read.pos.empty())
+	{
+		img.seek(buffer.read.pos.back() + buffer.read.sz.back());
+		QByteArray remaining = img.read(size - buffer.data.size());
+		buffer.data.append(remaining);
+		buffer.read.sz.back() += remaining.size();
+	}
+}
+
+void BundleRecovery::readHeaders(QIODevice& img, const FileInfo& info,
 	Bundle& bundle)
 {
 	if (!strncmp(bundle.magic, "bndl", 4))
@@ -150,8 +199,8 @@ void BundleRecovery::readHeaders(QFile& img, const FileInfo& info,
 		return;
 }
 
-void BundleRecovery::readDebugData(QFile& img, const FileInfo& info,
-	const Bundle& bundle, QString& debugData)
+void BundleRecovery::readDebugData(QIODevice& img, const FileInfo& info,
+	const Bundle& bundle, QByteArray& debugData)
 {
 	img.seek(info.pos[0] + bundle.debugDataOffset);
 	// TODO: Support reading bundle 2 v3/v5 debug data (comes at end of bundle)
@@ -169,7 +218,7 @@ void BundleRecovery::readDebugData(QFile& img, const FileInfo& info,
 	}
 }
 
-void BundleRecovery::readResourceIds(QFile& img, const FileInfo& info,
+void BundleRecovery::readResourceIds(QIODevice& img, const FileInfo& info,
 	const Bundle& bundle, std::vector<ResourceEntry>& resources)
 {
 	int idsLen = bundle.resourceEntriesCount * 8;
@@ -188,7 +237,7 @@ void BundleRecovery::readResourceIds(QFile& img, const FileInfo& info,
 	}
 }
 
-void BundleRecovery::readResourceEntries(QFile& img, const FileInfo& info,
+void BundleRecovery::readResourceEntries(QIODevice& img, const FileInfo& info,
 	const Bundle& bundle, std::vector<ResourceEntry>& resources)
 {
 	if (!strncmp(bundle.magic, "bndl", 4))
@@ -267,7 +316,7 @@ void BundleRecovery::readResourceEntries(QFile& img, const FileInfo& info,
 	}
 }
 
-void BundleRecovery::readResourceCompressionInfo(QFile& img,
+void BundleRecovery::readResourceCompressionInfo(QIODevice& img,
 	const FileInfo& info, const Bundle& bundle,
 	std::vector<ResourceEntry>& resources)
 {
@@ -294,7 +343,7 @@ void BundleRecovery::readResourceCompressionInfo(QFile& img,
 	}
 }
 
-void BundleRecovery::readResourceImports(QFile& img, const FileInfo& info,
+void BundleRecovery::readResourceImports(QIODevice& img, const FileInfo& info,
 	const Bundle& bundle, std::vector<ResourceEntry>& resources,
 	std::vector<std::vector<ImportEntry>>& imports)
 {
@@ -0,0 +1,200 @@
+#include "../SectorMap.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+static constexpr char sectorMapMagic[4] = { 'B', 'R', 'S', 'M' };
+static constexpr uint32_t sectorMapVersion = 1;
+
+// Below this many bytes per byte value, entropy is too low for deflate
+// output
+static constexpr double lowEntropyBits = 6.0;
+
+// Fragments with fewer bytes remaining than this may be mostly padding, so
+// they aren't rejected by their sector's contents
+static constexpr int minClassifiedSize = 0x10;
+
+SectorMap::~SectorMap()
+{
+	close();
+}
+
+bool SectorMap::open(const QString& path, uint64_t imageSize, int interval)
+{
+	close();
+
+	this->interval = interval;
+	sectors = (imageSize + interval - 1) / interval;
+
+	file.setFileName(path);
+	if (!file.open(QIODevice::ReadWrite))
+		return false;
+
+	// Start over if the map was made for a different image
+	Header header = {};
+	bool valid = file.read(reinterpret_cast<char*>(&header), sizeof(Header))
+		== sizeof(Header)
+		&& !memcmp(header.magic, sectorMapMagic, 4)
+		&& header.version == sectorMapVersion
+		&& header.interval == (uint32_t)interval
+		&& header.sectors == sectors;
+	if (!valid)
+	{
+		file.resize(0);
+		header = {};
+		memcpy(header.magic, sectorMapMagic, 4);
+		header.version = sectorMapVersion;
+		header.interval = interval;
+		header.sectors = sectors;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+	}
+	file.resize(sizeof(Header) + (sectors + 1) / 2);
+
+	types = file.map(sizeof(Header), (sectors + 1) / 2);
+	if (!types)
+	{
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void SectorMap::close()
+{
+	if (types)
+		file.unmap(types);
+	types = nullptr;
+	if (file.isOpen())
+		file.close();
+	sectors = 0;
+}
+
+SectorMap::Type SectorMap::classify(const char* data, int size)
+{
+	const uchar* bytes = reinterpret_cast<const uchar*>(data);
+
+	if (size >= 4 && (!strncmp(data, "bndl", 4) || !strncmp(data, "bnd2", 4)))
+		return Type::BundleHeader;
+
+	// Printable text up to the first null, then only nulls
+	int nonZero = 0;
+	bool text = true;
+	bool padding = false;
+	int histogram[256] = {};
+	for (int i = 0; i < size; ++i)
+	{
+		uchar c = bytes[i];
+		++histogram[c];
+		if (c != 0)
+			++nonZero;
+		if (c == 0)
+			padding = true;
+		else if (padding || ((c < 0x20 || c > 0x7E)
+			&& c != '\t' && c != '\n' && c != '\r'))
+			text = false;
+	}
+
+	if (nonZero == 0)
+		return Type::Zero;
+	if (text)
+		return Type::Text;
+
+	double entropy = 0;
+	for (int i = 0; i < 256; ++i)
+	{
+		if (histogram[i] == 0)
+			continue;
+		double p = (double)histogram[i] / size;
+		entropy -= p * std::log2(p);
+	}
+
+	return entropy < lowEntropyBits ? Type::LowEntropy : Type::HighEntropy;
+}
+
+bool SectorMap::containsZlibHeader(const char* data, int size)
+{
+	for (const char* c = data; c < data + size - 1; ++c)
+	{
+		c = static_cast<const char*>(memchr(c, 0x78, data + size - 1 - c));
+		if (!c)
+			return false;
+		if (static_cast<uchar>(c[1]) == 0xDA)
+			return true;
+	}
+
+	return false;
+}
+
+void SectorMap::set(uint64_t offset, Type type, bool zlibHeader)
+{
+	uint64_t sector = offset / interval;
+	if (!types || sector >= sectors)
+		return;
+
+	// Only this sector's bits are changed, so the other sector in the byte
+	// can be set by another thread at the same time
+	std::atomic_ref<uchar> byte(types[sector / 2]);
+	uchar shift = (sector & 1) * 4;
+	uchar value = static_cast<uchar>(type) | (zlibHeader ? zlibHeaderFlag : 0);
+	byte.fetch_and(~(0xF << shift));
+	byte.fetch_or(value << shift);
+}
+
+uchar SectorMap::bits(uint64_t offset) const
+{
+	uint64_t sector = offset / interval;
+	if (!types || sector >= sectors)
+		return 0;
+
+	uchar byte = std::atomic_ref<uchar>(types[sector / 2]).load(
+		std::memory_order_relaxed);
+	return (byte >> ((sector & 1) * 4)) & 0xF;
+}
+
+SectorMap::Type SectorMap::get(uint64_t offset) const
+{
+	return static_cast<Type>(bits(offset) & typeMask);
+}
+
+bool SectorMap::mayHaveZlibHeader(uint64_t offset) const
+{
+	// A header in the last byte of a sector continues into the next one
+	if (offset % interval == interval - 1)
+		return true;
+
+	uchar value = bits(offset);
+	return (value & typeMask) == static_cast<uchar>(Type::Unknown)
+		|| (value & zlibHeaderFlag);
+}
+
+bool SectorMap::mayStartFragment(uint64_t offset, Content content,
+	int size) const
+{
+	return mayStartFragment(get(offset), content, size);
+}
+
+bool SectorMap::mayStartFragment(Type type, Content content, int size) const
+{
+	if (type == Type::Unknown || size < minClassifiedSize)
+		return true;
+	if (type == Type::Zero || type == Type::BundleHeader)
+		return false;
+
+	// If the fragment ends within the sector, other data follows it
+	if (size < interval)
+		return true;
+
+	switch (content)
+	{
+	case Content::Text:
+		return type == Type::Text;
+	case Content::Binary:
+		return type != Type::Text;
+	case Content::Compressed:
+		return type == Type::HighEntropy;
+	}
+
+	return true;
+}
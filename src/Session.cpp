@@ -0,0 +1,304 @@
+#include "../BundleRecovery.h"
+
+#include <algorithm>
+
+#include <CRC.h>
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QStandardPaths>
+
+static uint32_t crc32(const char* data, size_t size)
+{
+	static const CRC::Table<std::uint32_t, 32> crcTable(CRC::CRC_32());
+	return CRC::Calculate(data, size, crcTable);
+}
+
+QString BundleRecovery::sessionPath()
+{
+	// One journal per image
+	QByteArray key = imageKey().toUtf8();
+	return QStandardPaths::standardLocations(QStandardPaths::AppDataLocation)[0]
+		+ "/../burninrubber0/BundleRecovery/"
+		+ QString::number(crc32(key.constData(), key.size()), 16).toUpper()
+		+ ".journal";
+}
+
+QString BundleRecovery::imageKey()
+{
+	// Validation results depend on the search interval and platform as well as
+	// the image itself
+	QFileInfo image(input);
+	return image.canonicalFilePath()
+		+ "|" + QString::number(image.size())
+		+ "|" + QString::number(image.lastModified().toMSecsSinceEpoch())
+		+ "|" + QString::number(interval)
+		+ "|" + (endianness == std::endian::big ? "be" : "le");
+}
+
+uint32_t BundleRecovery::getMetadataHash(QIODevice& img, const FileInfo& info,
+	const Bundle& bundle)
+{
+	// Everything before the resource data, capped in case the header is
+	// corrupt
+	uint32_t length = std::min(bundle.resourceDataOffset[0], 0x800000u);
+	if (length == 0)
+		length = 0x800000;
+
+	img.seek(info.pos[0]);
+	QByteArray metadata = img.read(length);
+
+	return crc32(metadata.constData(), metadata.size());
+}
+
+void BundleRecovery::loadCheckpoint()
+{
+	QMutexLocker locker(&checkpointMutex);
+
+	checkpoint = {};
+
+	QString path = sessionPath();
+	QDir().mkpath(QFileInfo(path).absolutePath());
+
+	if (!sectorMap.open(path + ".sectors", QFileInfo(input).size(), interval))
+		log("Failed to open sector map, fragment candidates will not be "
+			"filtered");
+	QByteArray key = imageKey().toUtf8();
+	if (!journal.open(path, crc32(key.constData(), key.size())))
+	{
+		log("Failed to open session journal, progress will not be saved");
+		return;
+	}
+
+	// Scan progress only applies if the same versions were searched for
+	int validated = 0;
+	int defragged = 0;
+	journal.forEach([this, &validated, &defragged](int64_t index,
+		const Journal::Record& record)
+		{
+			if (record.type == Journal::RecordType::Scanned
+				&& record.state == versionLimit)
+				mergeScanned(record.offset, record.data[0]);
+			else if (record.type == Journal::RecordType::Found
+				&& record.state == versionLimit)
+			{
+				Bundle bundle = {};
+				memcpy(bundle.magic, &record.value, 4);
+				bundle.version = record.count;
+				checkpoint.found[record.offset] = bundle;
+			}
+			else if (record.type == Journal::RecordType::Validated
+				&& record.count == validatorVersion)
+				++validated;
+			else if (record.type == Journal::RecordType::Defragged)
+				++defragged;
+		});
+
+	if (!checkpoint.scanned.empty() || validated != 0)
+		log("Resuming from checkpoint: " + QString::number(
+			checkpoint.found.size()) + " bundles previously found, "
+			+ QString::number(validated) + " validation and "
+			+ QString::number(defragged) + " defragmentation results");
+}
+
+void BundleRecovery::saveCheckpoint()
+{
+	journal.buildIndex();
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> BundleRecovery::getScannedRanges()
+{
+	QMutexLocker locker(&checkpointMutex);
+	return checkpoint.scanned;
+}
+
+void BundleRecovery::mergeScanned(uint64_t start, uint64_t end)
+{
+	// Insert the range, then merge any that overlap or touch
+	auto& scanned = checkpoint.scanned;
+	scanned.push_back({ start, end });
+	std::sort(scanned.begin(), scanned.end());
+	std::vector<std::pair<uint64_t, uint64_t>> merged;
+	for (const auto& range : scanned)
+	{
+		if (!merged.empty() && range.first <= merged.back().second)
+			merged.back().second = std::max(merged.back().second, range.second);
+		else
+			merged.push_back(range);
+	}
+	scanned = merged;
+}
+
+void BundleRecovery::recordScanned(uint64_t start, uint64_t end)
+{
+	if (start >= end)
+		return;
+
+	checkpointMutex.lock();
+	mergeScanned(start, end);
+	checkpointMutex.unlock();
+
+	Journal::Record record = {};
+	record.type = Journal::RecordType::Scanned;
+	record.state = versionLimit;
+	record.offset = start;
+	record.data[0] = end;
+	journal.append(&record, 1);
+}
+
+void BundleRecovery::recordFound(uint64_t offset, const Bundle& bundle)
+{
+	checkpointMutex.lock();
+	checkpoint.found[offset] = bundle;
+	checkpointMutex.unlock();
+
+	Journal::Record record = {};
+	record.type = Journal::RecordType::Found;
+	record.state = versionLimit;
+	record.count = bundle.version;
+	memcpy(&record.value, bundle.magic, 4);
+	record.offset = offset;
+	journal.append(&record, 1);
+}
+
+void BundleRecovery::resumeFound(std::vector<FileInfo>& info,
+	std::vector<Bundle>& bundles, uint64_t start, uint64_t end)
+{
+	QMutexLocker locker(&checkpointMutex);
+
+	// Bundles outside of completed ranges will be found again by the Finder
+	auto range = checkpoint.scanned.begin();
+	for (auto found = checkpoint.found.lower_bound(start);
+		found != checkpoint.found.end() && found->first < end; ++found)
+	{
+		while (range != checkpoint.scanned.end()
+			&& range->second <= found->first)
+			++range;
+		if (range == checkpoint.scanned.end())
+			break;
+		if (range->first > found->first)
+			continue;
+
+		info.push_back({ { found->first }, {} });
+		bundles.push_back(found->second);
+	}
+}
+
+bool BundleRecovery::applyCachedValidation(FileInfo& info, uint32_t hash,
+	CorruptionType& corrupt)
+{
+	int64_t index;
+	if (!journal.find(info.pos[0], Journal::RecordType::Validated, index))
+		return false;
+	Journal::Record record = journal.at(index);
+	if (record.value != hash || record.count != validatorVersion)
+		return false;
+
+	corrupt = static_cast<CorruptionType>(record.state);
+	if (corrupt == CorruptionType::Intact
+		|| corrupt == CorruptionType::Uncompressed)
+		info.sz.push_back(record.data[0]);
+	else
+		info.sz.push_back(record.data[1]);
+
+	return true;
+}
+
+void BundleRecovery::recordValidation(const FileInfo& info, uint32_t hash,
+	CorruptionType corrupt)
+{
+	if (info.sz.empty())
+		return; // Not validated
+
+	bool intact = corrupt == CorruptionType::Intact
+		|| corrupt == CorruptionType::Uncompressed;
+	Journal::Record record = {};
+	record.type = Journal::RecordType::Validated;
+	record.state = static_cast<uint8_t>(corrupt);
+	record.count = validatorVersion;
+	record.value = hash;
+	record.offset = info.pos[0];
+	record.data[0] = intact ? info.sz[0] : 0;
+	record.data[1] = intact ? 0 : info.sz[0];
+	journal.append(&record, 1);
+}
+
+bool BundleRecovery::applyDefragCheckpoint(FileInfo& info,
+	CorruptionType& corrupt)
+{
+	int64_t index;
+	if (!journal.find(info.pos[0], Journal::RecordType::Defragged, index))
+		return false;
+	Journal::Record record = journal.at(index);
+
+	// Failed defrags are retried if the search settings changed
+	CorruptionType saved = static_cast<CorruptionType>(record.state);
+	if (saved != CorruptionType::Intact
+		&& saved != CorruptionType::Uncompressed
+		&& (record.data[0] != searchLength
+			|| record.data[1] != beamWidth
+			|| record.value != ui.checkBoxSearchAll->isChecked()))
+		return false;
+
+	// Results cut short by a crash are done again
+	if (index + record.count >= journal.size())
+		return false;
+	FileInfo fragments;
+	for (int i = 1; i <= record.count; ++i)
+	{
+		Journal::Record fragment = journal.at(index + i);
+		if (fragment.type != Journal::RecordType::Fragment)
+			return false;
+		fragments.pos.push_back(fragment.data[0]);
+		fragments.sz.push_back(fragment.data[1]);
+	}
+	if (fragments.pos.empty())
+		return false;
+
+	info = fragments;
+	corrupt = saved;
+
+	return true;
+}
+
+void BundleRecovery::recordDefrag(const FileInfo& info, CorruptionType corrupt)
+{
+	// The result and its fragments are written as one block
+	std::vector<Journal::Record> records(info.pos.size() + 1);
+	records[0].type = Journal::RecordType::Defragged;
+	records[0].state = static_cast<uint8_t>(corrupt);
+	records[0].count = info.pos.size();
+	records[0].value = ui.checkBoxSearchAll->isChecked();
+	records[0].offset = info.pos[0];
+	records[0].data[0] = searchLength;
+	records[0].data[1] = beamWidth;
+	for (int i = 0; i < info.pos.size(); ++i)
+	{
+		records[i + 1].type = Journal::RecordType::Fragment;
+		records[i + 1].offset = info.pos[0];
+		records[i + 1].data[0] = info.pos[i];
+		records[i + 1].data[1] = info.sz[i];
+	}
+	journal.append(records.data(), records.size());
+}
+
+bool BundleRecovery::isExtracted(const FileInfo& info, const QString& path)
+{
+	int64_t index;
+	if (!journal.find(info.pos[0], Journal::RecordType::Extracted, index))
+		return false;
+
+	QByteArray utf8 = path.toUtf8();
+	return journal.at(index).value == crc32(utf8.constData(), utf8.size())
+		&& QFile::exists(path);
+}
+
+void BundleRecovery::recordExtracted(const FileInfo& info, const QString& path)
+{
+	QByteArray utf8 = path.toUtf8();
+	Journal::Record record = {};
+	record.type = Journal::RecordType::Extracted;
+	record.value = crc32(utf8.constData(), utf8.size());
+	record.offset = info.pos[0];
+	journal.append(&record, 1);
+}
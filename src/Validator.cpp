@@ -1,4 +1,8 @@
 #include "../BundleRecovery.h"
+#include "../XmlChecker.h"
+
+#include <algorithm>
+#include <cstring>
 
 #include <libdeflate.h>
 
@@ -7,24 +11,38 @@
 #include <QByteArray>
 #include <QDateTime>
 #include <QDataStream>
-#include <QXmlStreamReader>
+#include <QtEndian>
 
 void BundleRecovery::validateBundles(std::vector<FileInfo>& info,
-	std::vector<Bundle>& bundles, std::vector<QString>& debugData,
+	std::vector<Bundle>& bundles, std::vector<QByteArray>& debugData,
 	std::vector<std::vector<ResourceEntry>>& resources,
 	std::vector<std::vector<std::vector<ImportEntry>>>& imports,
-	std::vector<CorruptionType>& corrupt, int start, int end, int threadId)
+	std::vector<CorruptionType>& corrupt, std::vector<uint32_t>& hashes,
+	std::vector<BundleBuffer>& buffers, int start, int end, int threadId)
 {
-	log("Thread " + QString::number(threadId)
-		+ " delegated bundles " + QString::number(start)
-		+ " to " + QString::number(end - 1));
-	uint64_t dateTimePre = QDateTime::currentSecsSinceEpoch();
+	CachedImage image(imageCache);
 
-	QFile image(input);
-	image.open(QIODevice::ReadOnly);
+	bool cached = false; // Whether the last result came from the journal
 
 	for (int i = start; i < end; ++i)
 	{
+		// Bundle sizes vary widely, so the work done is counted in bytes
+		ConcurrencyController::Permit permit(cpuThreads,
+			std::max(GetBundleSize(bundles[i], resources[i]), 0));
+
+		// Checkpoint the result of the previous bundle
+		if (i > start && !cached)
+			recordValidation(info[i - 1], hashes[i - 1], corrupt[i - 1]);
+
+		// Reuse the result of a previous run if the bundle is unchanged
+		hashes[i] = getMetadataHash(image, info[i], bundles[i]);
+		cached = applyCachedValidation(info[i], hashes[i], corrupt[i]);
+		if (cached)
+		{
+			logCorruption(info[i].pos[0], corrupt[i]);
+			continue;
+		}
+
 		// Validate Bundle 2 debug data, if present
 		// TODO: Support v3/v5 (not used by the bundle, just nice to have)
 		if (!strncmp(bundles[i].magic, "bnd2", 4)
@@ -167,12 +185,17 @@ void BundleRecovery::validateBundles(std::vector<FileInfo>& info,
 			continue;
 		}
 
-		// Validate the integrity of compressed resources
-		if (validateCompressedResources(image, info[i], bundles[i], resources[i]))
+		// Validate the integrity of compressed resources. The data is kept
+		// only if the Defragmenter will need it.
+		BundleBuffer& buffer = buffers[i];
+		readBundleData(image, info[i], buffer);
+		if (validateCompressedResources(buffer, bundles[i], resources[i]))
 			corrupt[i] = CorruptionType::ZlibData;
 		if (corrupt[i] == CorruptionType::ZlibData)
 			info[i].sz[0] = getCompressedResourcesFailPos(
-				image, info[i], bundles[i], resources[i]);
+				buffer, bundles[i], resources[i]);
+		else
+			buffer = {};
 		if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
 			return;
 		if (corrupt[i] != CorruptionType::Intact)
@@ -181,15 +204,15 @@ void BundleRecovery::validateBundles(std::vector<FileInfo>& info,
 			continue;
 		}
 	}
+	if (end > start && !cached)
+		recordValidation(info[end - 1], hashes[end - 1], corrupt[end - 1]);
 
 	image.close();
-	uint64_t timeTaken = QDateTime::currentSecsSinceEpoch() - dateTimePre;
-	log("Thread " + QString::number(threadId)
-		+ " finished in " + QString::number(timeTaken) + " seconds");
 }
 
-void BundleRecovery::validateSingleBundle(QFile& img, FileInfo& info,
-	Bundle& bundle, QString& debugData, std::vector<ResourceEntry>& resources,
+void BundleRecovery::validateSingleBundle(QIODevice& img, FileInfo& info,
+	Bundle& bundle, BundleBuffer& buffer, QByteArray& debugData,
+	std::vector<ResourceEntry>& resources,
 	std::vector<std::vector<ImportEntry>>& imports, CorruptionType& corrupt)
 {
 	// Validate Bundle 2 debug data, if present
@@ -258,33 +281,29 @@ void BundleRecovery::validateSingleBundle(QFile& img, FileInfo& info,
 		return;
 
 	// Validate the integrity of compressed resources
-	if (validateCompressedResources(img, info, bundle, resources))
+	readBundleData(img, info, buffer);
+	if (validateCompressedResources(buffer, bundle, resources))
 		corrupt = CorruptionType::ZlibData;
 	if (!ui.pushButtonStop->isEnabled()) // Cancel pressed
 		return;
 }
 
 int BundleRecovery::getDebugDataFailPos(const Bundle& bundle,
-	const QString& debugData)
+	const QByteArray& debugData)
 {
-	QXmlStreamReader debugDataReader(debugData);
-	while (!debugDataReader.atEnd() && !debugDataReader.hasError())
-		debugDataReader.readNext();
-
-	int end = binaryio::Align(bundle.debugDataOffset
-		+ debugDataReader.characterOffset(), 0x10);
+	XmlChecker checker;
+	checker.feed(debugData.constData(), debugData.size());
+	if (checker.complete())
+		return 0;
 
-	if (debugDataReader.hasError())
-	{
-		// Remove potential error from the XML reader reading beyond the
-		// fragment end
-		if (end > 0x4000 && (end & 0xFFF) != 0)
-			return end & 0xFFFFC000;
+	int end = binaryio::Align(bundle.debugDataOffset + checker.offset(), 0x10);
 
-		return end;
-	}
+	// Remove potential error from the XML checker reading beyond the
+	// fragment end
+	if (end > 0x4000 && (end & 0xFFF) != 0)
+		return end & 0xFFFFC000;
 
-	return 0;
+	return end;
 }
 
 int BundleRecovery::getResourceIdsFailPos(const Bundle& bundle,
@@ -310,8 +329,7 @@ int BundleRecovery::getResourceEntriesFailPos(const Bundle& bundle,
 		for (int i = 0; i < resources.size(); ++i)
 		{
 			// Validate resource type
-			// TODO: Make this more specific (most of the 0x11k aren't type ids)
-			if (resources[i].resourceTypeId > 0x11004)
+			if (!IsKnownResourceType(bundle, resources[i].resourceTypeId))
 				return bundle.resourceEntriesOffset + i * 0x70 + 8;
 
 			for (int j = 0; j < chunkCount; ++j)
@@ -362,7 +380,7 @@ int BundleRecovery::getResourceEntriesFailPos(const Bundle& bundle,
 					= ((resources[i].resourceId & 0xFF00000000000000) >> 56);
 				uint8_t idResourceType
 					= ((resources[i].resourceId & 0x000000FF00000000) >> 32);
-				uint8_t idResourceId
+				uint32_t idResourceId
 					= (resources[i].resourceId & 0x00000000FFFFFFFF);
 				if (idType != 0 && idType != 1
 					&& idType != 0x80 && idType != 0xC0)
@@ -432,20 +450,14 @@ int BundleRecovery::getResourceEntriesFailPos(const Bundle& bundle,
 			}
 
 			// Validate resource type
-			// TODO: Make this more specific (most aren't type ids)
-			if (bundle.version <= 3)
+			// TODO: Use a list of known types for v5 once one is verified
+			if (!IsKnownResourceType(bundle, resources[i].resourceTypeId))
 			{
-				if (resources[i].resourceTypeId > 0x11004)
-				{
-					if (bundle.version == 2)
-						return bundle.resourceEntriesOffset + i * 0x40 + 0x38;
-					else
-						return bundle.resourceEntriesOffset + i * 0x50 + 0x44;
-				}
-			}
-			else
-			{
-				if (resources[i].resourceTypeId > 0x701)
+				if (bundle.version == 2)
+					return bundle.resourceEntriesOffset + i * 0x40 + 0x38;
+				else if (bundle.version == 3)
+					return bundle.resourceEntriesOffset + i * 0x50 + 0x44;
+				else
 					return bundle.resourceEntriesOffset + i * 0x48 + 0x3C;
 			}
 		}
@@ -454,6 +466,141 @@ int BundleRecovery::getResourceEntriesFailPos(const Bundle& bundle,
 	return 0;
 }
 
+// Returns a field of a raw resource entry stored in the byte order.
+template <std::endian order, typename T>
+static T loadEntryField(const char* field)
+{
+	if constexpr (order == std::endian::big)
+		return qFromBigEndian<T>(field);
+	else
+		return qFromLittleEndian<T>(field);
+}
+
+// Sets failed for each of the count entries at batch which fails the ID,
+// headroom or chunk bounds checks of getResourceEntriesFailPos. Fields are
+// gathered into one lane per entry, then every check runs across all lanes
+// at once without branching, so the compiler can use vector instructions.
+template <std::endian order, int lanes>
+static void checkRawEntryBatch(const uint32_t* resourceDataOffset,
+	uint32_t version, int chunkCount, int entrySize, int saaOffset,
+	const char* batch, int count, uint32_t* failed)
+{
+	uint64_t ids[lanes] = {};
+	uint64_t hashes[lanes] = {};
+	for (int i = 0; i < count; ++i)
+	{
+		ids[i] = loadEntryField<order, uint64_t>(batch + i * entrySize);
+		if (version == 2)
+			hashes[i] = loadEntryField<order, uint64_t>(
+				batch + i * entrySize + 8);
+	}
+
+	if (version == 2)
+	{
+		for (int i = 0; i < lanes; ++i)
+			failed[i] = (ids[i] > 0xFFFFFFFF) | (hashes[i] > 0xFFFFFFFF);
+	}
+	else
+	{
+		for (int i = 0; i < lanes; ++i)
+		{
+			uint32_t idType = ids[i] >> 56;
+			uint32_t idResourceType = (ids[i] >> 32) & 0xFF;
+			uint32_t idResourceId = ids[i] & 0xFFFFFFFF;
+			failed[i] = (idType != 0) & (idType != 1) & (idType != 0x80)
+				& (idType != 0xC0);
+			failed[i] |= (idType == 0)
+				& ((ids[i] & 0x00FFFFFFFFFFFFFF) > 0xFFFFFFFF);
+			failed[i] |= (idType == 1) & (idResourceType == 0)
+				& (idResourceId > 0x300000) & (idResourceId < 0xFFFFFFF8);
+		}
+	}
+
+	for (int j = 0; j < chunkCount; ++j)
+	{
+		uint32_t sizes[lanes] = {};
+		uint32_t saas[lanes] = {};
+		uint32_t diskOffsets[lanes] = {};
+		for (int i = 0; i < count; ++i)
+		{
+			const char* entry = batch + i * entrySize + saaOffset + j * 4;
+			sizes[i] = loadEntryField<order, uint32_t>(entry);
+			saas[i] = loadEntryField<order, uint32_t>(entry + chunkCount * 4);
+			diskOffsets[i] = loadEntryField<order, uint32_t>(
+				entry + chunkCount * 8);
+		}
+
+		// Headroom, then all but the last chunk's bounds
+		for (int i = 0; i < lanes; ++i)
+			failed[i] |= (sizes[i] & 0x0FFFFFFF) + 13
+				< (saas[i] & 0x0FFFFFFF);
+		if (j == chunkCount - 1)
+			continue;
+		uint32_t start = resourceDataOffset[j];
+		uint32_t next = resourceDataOffset[j + 1];
+		for (int i = 0; i < lanes; ++i)
+			failed[i] |= (saas[i] != 0)
+				& (start + diskOffsets[i] + (saas[i] & 0x0FFFFFFF) > next);
+	}
+}
+
+int BundleRecovery::getRawResourceEntriesFailIndex(const Bundle& bundle,
+	const char* entries, int first, int count)
+{
+	int8_t chunkCount = GetChunkCount(bundle);
+	int entrySize = ResourceEntrySize(bundle);
+	int saaOffset = bundle.version <= 3 ? 0x10 : 8; // After the ID(s)
+	int typeOffset = saaOffset + chunkCount * 12 + 4;
+	bool bigEndian = endianness == std::endian::big;
+	auto load32 = [bigEndian](const char* field)
+		{
+			return bigEndian ? qFromBigEndian<uint32_t>(field)
+				: qFromLittleEndian<uint32_t>(field);
+		};
+	auto load64 = [bigEndian](const char* field)
+		{
+			return bigEndian ? qFromBigEndian<uint64_t>(field)
+				: qFromLittleEndian<uint64_t>(field);
+		};
+
+	// The v2 ID order also involves the entry before the first
+	if (bundle.version == 2 && first > 0)
+		--first;
+
+	for (int batch = first; batch < count; batch += rawEntryBatchSize)
+	{
+		int batchSize = std::min(rawEntryBatchSize, count - batch);
+		const char* batchEntries = entries + batch * entrySize;
+
+		// The byte order is chosen once per batch rather than per field
+		uint32_t failed[rawEntryBatchSize];
+		if (bigEndian)
+			checkRawEntryBatch<std::endian::big, rawEntryBatchSize>(
+				bundle.resourceDataOffset, bundle.version, chunkCount,
+				entrySize, saaOffset, batchEntries, batchSize, failed);
+		else
+			checkRawEntryBatch<std::endian::little, rawEntryBatchSize>(
+				bundle.resourceDataOffset, bundle.version, chunkCount,
+				entrySize, saaOffset, batchEntries, batchSize, failed);
+
+		// The ID order and type lookup are done one entry at a time
+		for (int i = 0; i < batchSize; ++i)
+		{
+			int index = batch + i;
+			const char* entry = entries + index * entrySize;
+			if (failed[i])
+				return index;
+			if (bundle.version == 2 && index < count - 1
+				&& load64(entry) > load64(entry + entrySize))
+				return index;
+			if (!IsKnownResourceType(bundle, load32(entry + typeOffset)))
+				return index;
+		}
+	}
+
+	return -1;
+}
+
 int BundleRecovery::getResourceCompressionInfoFailPos(const Bundle& bundle,
 	const std::vector<ResourceEntry>& resources)
 {
@@ -503,17 +650,10 @@ int BundleRecovery::getResourceImportsFailPos(
 	return 0;
 }
 
-bool BundleRecovery::validateCompressedResources(QFile& img,
-	const FileInfo& info, const Bundle& bundle,
-	const std::vector<ResourceEntry>& resources)
+bool BundleRecovery::validateCompressedResources(const BundleBuffer& buffer,
+	const Bundle& bundle, const std::vector<ResourceEntry>& resources)
 {
-	QByteArray bundleData;
-	for (int i = 0; i < info.pos.size(); ++i)
-	{
-		img.seek(info.pos[i]);
-		bundleData.append(img.read(info.sz[i]));
-	}
-	QDataStream stream(&bundleData, QIODevice::ReadOnly);
+	QDataStream stream(buffer.data);
 	if (endianness == std::endian::little)
 		stream.setByteOrder(QDataStream::LittleEndian);
 
@@ -572,23 +712,12 @@ bool BundleRecovery::validateCompressedResources(QFile& img,
 	return false;
 }
 
-int BundleRecovery::getCompressedResourcesFailPos(QFile& img,
-	const FileInfo& info, const Bundle& bundle,
-	const std::vector<ResourceEntry>& resources)
+int BundleRecovery::getCompressedResourcesFailPos(const BundleBuffer& buffer,
+	const Bundle& bundle, const std::vector<ResourceEntry>& resources)
 {
 	// TODO: Switch to using libdeflate exclusively, getting the fail position
 	// via the index and chunk index of the resource where it fails
 
-	QByteArray bundleData;
-	for (int i = 0; i < info.pos.size(); ++i)
-	{
-		img.seek(info.pos[i]);
-		bundleData.append(img.read(info.sz[i]));
-	}
-	QDataStream stream(&bundleData, QIODevice::ReadOnly);
-	if (endianness == std::endian::little)
-		stream.setByteOrder(QDataStream::LittleEndian);
-
 	int8_t chunkCount = GetChunkCount(bundle);
 
 	if (!strncmp(bundle.magic, "bndl", 4))
@@ -601,38 +730,15 @@ int BundleRecovery::getCompressedResourcesFailPos(QFile& img,
 				int uSz = resources[i].compressionInfo[j].size;
 				if (cSz != 0)
 				{
-					std::unique_ptr<char[]> resourceData(new char[cSz]);
 					int resourcePos = 0;
 					for (int k = 0; k < j; ++k)
 						resourcePos += bundle.chunkSaas[k].size;
 					resourcePos += resources[i].bndlDiskOffset[j].size;
-					
-					// Check header, since zlib seemingly doesn't do it
-					stream.device()->seek(resourcePos);
-					uint16_t header = 0;
-					stream >> header;
-					if (header != 0x78DA)
-						return resourcePos;
 
-					// Check for invalid or extremely unlikely bytecode
-					for (int k = interval; k < cSz; k += interval)
-					{
-						stream.device()->seek(
-							(resourcePos + k) & (~(interval - 1)));
-						uint32_t toCheck = 0;
-						stream >> toCheck;
-						if (toCheck == 0x626E6432 || toCheck == 0x626E646C
-							|| toCheck == 0x3C3F786D || toCheck == 0x126AF046
-							|| toCheck == 0)
-							return resourcePos + k;
-					}
-
-					// Check data
-					stream.device()->seek(resourcePos);
-					stream.readRawData(resourceData.get(), cSz);
-					int read = GetZlibBytesRead(resourceData.get(), cSz, uSz);
-					if (read != cSz)
-						return resourcePos + read;
+					int failPos = getCompressedResourceFailPos(buffer,
+						resourcePos, cSz, uSz);
+					if (failPos != 0)
+						return failPos;
 				}
 			}
 		}
@@ -647,40 +753,103 @@ int BundleRecovery::getCompressedResourcesFailPos(QFile& img,
 				int uSz = GetSizeFromSAA(resources[i].uncompressedSaa[j]);
 				if (resources[i].saaOnDisk[j] != 0)
 				{
-					std::unique_ptr<char[]> resourceData(new char[cSz]);
-					int resourcePos = bundle.resourceDataOffset[j]
-						+ resources[i].diskOffset[j];
+					int failPos = getCompressedResourceFailPos(buffer,
+						bundle.resourceDataOffset[j] + resources[i].diskOffset[j],
+						cSz, uSz);
+					if (failPos != 0)
+						return failPos;
+				}
+			}
+		}
+	}
 
-					// Check header, since zlib seemingly doesn't do it
-					stream.device()->seek(resourcePos);
-					uint16_t header = 0;
-					stream >> header;
-					if (header != 0x78DA)
-						return resourcePos/* & (~(interval - 1))*/;
+	return 0;
+}
 
-					// Check for invalid or extremely unlikely bytecode
-					for (int k = interval; k < cSz; k += interval)
-					{
-						stream.device()->seek(
-							(resourcePos + k) & (~(interval - 1)));
-						uint32_t toCheck = 0;
-						stream >> toCheck;
-						if (toCheck == 0x626E6432 || toCheck == 0x626E646C
-							|| toCheck == 0x3C3F786D || toCheck == 0x126AF046
-							|| toCheck == 0)
-							return resourcePos + k;
-					}
+int BundleRecovery::getCompressedResourceFailPos(const BundleBuffer& buffer,
+	int resourcePos, int cSz, int uSz)
+{
+	QDataStream stream(buffer.data);
+	if (endianness == std::endian::little)
+		stream.setByteOrder(QDataStream::LittleEndian);
 
-					// Check data
-					stream.device()->seek(resourcePos);
-					stream.readRawData(resourceData.get(), cSz);
-					int read = GetZlibBytesRead(resourceData.get(), cSz, uSz);
-					if (read != cSz)
-						return resourcePos + read;
-				}
+	// Check header, since zlib seemingly doesn't do it
+	stream.device()->seek(resourcePos);
+	uint16_t header = 0;
+	stream >> header;
+	if (header != 0x78DA)
+		return resourcePos/* & (~(interval - 1))*/;
+
+	// Check for invalid or extremely unlikely bytecode
+	for (int k = interval; k < cSz; k += interval)
+	{
+		stream.device()->seek(
+			(resourcePos + k) & (~(interval - 1)));
+		uint32_t toCheck = 0;
+		stream >> toCheck;
+		if (toCheck == 0x626E6432 || toCheck == 0x626E646C
+			|| toCheck == 0x3C3F786D || toCheck == 0x126AF046
+			|| toCheck == 0)
+			return resourcePos + k;
+	}
+
+	// Check data
+	std::unique_ptr<char[]> resourceData(new char[cSz]);
+	stream.device()->seek(resourcePos);
+	stream.readRawData(resourceData.get(), cSz);
+	int read = GetZlibBytesRead(resourceData.get(), cSz, uSz);
+	if (read != cSz)
+		return resourcePos + read;
+
+	return 0;
+}
+
+bool BundleRecovery::checkCompressedResources(const BundleBuffer& buffer,
+	const Bundle& bundle, const std::vector<ResourceEntry>& resources,
+	std::vector<bool>& valid, int from, int& resourceIndex, int& chunkIndex)
+{
+	int8_t chunkCount = GetChunkCount(bundle);
+	valid.resize(chunkCount * resources.size());
+
+	libdeflate_decompressor* dc = libdeflate_alloc_decompressor();
+	bool intact = true;
+	for (int j = 0; j < chunkCount && intact; ++j)
+	{
+		for (int i = 0; i < resources.size(); ++i)
+		{
+			int cSz = GetSizeFromSAA(resources[i].saaOnDisk[j]);
+			int uSz = GetSizeFromSAA(resources[i].uncompressedSaa[j]);
+			if (cSz == 0)
+				continue;
+			int resourcePos = bundle.resourceDataOffset[j]
+				+ resources[i].diskOffset[j];
+
+			// Data before from hasn't changed since the resource was checked
+			int slot = j * resources.size() + i;
+			if (resourcePos + cSz > from)
+				valid[slot] = false;
+			if (valid[slot])
+				continue;
+
+			// Resources cut off by the end of the buffer are corrupt
+			if (resourcePos + cSz <= buffer.data.size())
+			{
+				std::unique_ptr<char[]> resourceData(new char[cSz]);
+				memcpy(resourceData.get(),
+					buffer.data.constData() + resourcePos, cSz);
+				valid[slot] = GetLibdeflateResult(resourceData.get(), cSz, uSz,
+					dc) == LIBDEFLATE_SUCCESS;
+			}
+			if (!valid[slot])
+			{
+				resourceIndex = i;
+				chunkIndex = j;
+				intact = false;
+				break;
 			}
 		}
 	}
+	libdeflate_free_decompressor(dc);
 
-	return 0;
+	return intact;
 }
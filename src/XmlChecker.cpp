@@ -0,0 +1,379 @@
+#include "../XmlChecker.h"
+
+// FNV-1a, for matching end tags with start tags
+static constexpr uint32_t hashBasis = 0x811C9DC5;
+static constexpr uint32_t hashPrime = 0x01000193;
+
+// Predefined entities, packed as their name's bytes
+static constexpr uint32_t entityAmp = 'a' << 16 | 'm' << 8 | 'p';
+static constexpr uint32_t entityLt = 'l' << 8 | 't';
+static constexpr uint32_t entityGt = 'g' << 8 | 't';
+static constexpr uint32_t entityQuot = 'q' << 24 | 'u' << 16 | 'o' << 8 | 't';
+static constexpr uint32_t entityApos = 'a' << 24 | 'p' << 16 | 'o' << 8 | 's';
+
+bool XmlChecker::feed(const char* data, int size)
+{
+	for (int i = 0; i < size && state != State::Error && !stopped; ++i)
+	{
+		uint8_t c = data[i];
+		if (c == '\0')
+		{
+			stopped = true;
+			break;
+		}
+		++position;
+		check(c);
+	}
+
+	return state != State::Error;
+}
+
+bool XmlChecker::complete() const
+{
+	return state == State::Content && rootClosed;
+}
+
+bool XmlChecker::failed() const
+{
+	return state == State::Error;
+}
+
+bool XmlChecker::ended() const
+{
+	return stopped;
+}
+
+int XmlChecker::offset() const
+{
+	return position;
+}
+
+void XmlChecker::check(uint8_t c)
+{
+	// Control characters are never allowed
+	if (c < 0x20 && !isSpace(c))
+	{
+		state = State::Error;
+		return;
+	}
+
+	switch (state)
+	{
+	case State::Content:
+		if (c == '<')
+			state = State::TagOpen;
+		else if (depth == 0 && !isSpace(c))
+			state = State::Error; // Text outside of the root element
+		else if (c == '&')
+		{
+			referenceReturn = State::Content;
+			reference = 0;
+			referenceLength = 0;
+			state = State::Reference;
+		}
+		break;
+	case State::TagOpen:
+		nameHash = (hashBasis ^ c) * hashPrime;
+		nameLength = 1;
+		if (c == '?')
+		{
+			matched = 0;
+			state = State::ProcessingInstruction;
+		}
+		else if (c == '!')
+		{
+			literal = nullptr;
+			matched = 0;
+			state = State::Markup;
+		}
+		else if (c == '/')
+		{
+			nameHash = hashBasis;
+			nameLength = 0;
+			state = State::EndTagName;
+		}
+		else if (isNameStart(c))
+			state = State::StartTagName;
+		else
+			state = State::Error;
+		break;
+	case State::StartTagName:
+		if (isName(c))
+		{
+			nameHash = (nameHash ^ c) * hashPrime;
+			++nameLength;
+		}
+		else if (isSpace(c))
+		{
+			spaced = true;
+			state = State::InTag;
+		}
+		else if (c == '/')
+			state = State::EmptyTagEnd;
+		else if (c == '>')
+		{
+			openElement();
+			if (state != State::Error)
+				state = State::Content;
+		}
+		else
+			state = State::Error;
+		break;
+	case State::InTag:
+	case State::AfterValue:
+		if (isSpace(c))
+		{
+			spaced = true;
+			state = State::InTag;
+		}
+		else if (c == '/')
+			state = State::EmptyTagEnd;
+		else if (c == '>')
+		{
+			openElement();
+			if (state != State::Error)
+				state = State::Content;
+		}
+		else if (isNameStart(c) && spaced)
+			state = State::AttributeName;
+		else
+			state = State::Error;
+		break;
+	case State::AttributeName:
+		if (c == '=')
+			state = State::BeforeValue;
+		else if (isSpace(c))
+			state = State::AfterAttributeName;
+		else if (!isName(c))
+			state = State::Error;
+		break;
+	case State::AfterAttributeName:
+		if (c == '=')
+			state = State::BeforeValue;
+		else if (!isSpace(c))
+			state = State::Error;
+		break;
+	case State::BeforeValue:
+		if (c == '"' || c == '\'')
+		{
+			quote = c;
+			state = State::Value;
+		}
+		else if (!isSpace(c))
+			state = State::Error;
+		break;
+	case State::Value:
+		if (c == quote)
+		{
+			spaced = false;
+			state = State::AfterValue;
+		}
+		else if (c == '<')
+			state = State::Error;
+		else if (c == '&')
+		{
+			referenceReturn = State::Value;
+			reference = 0;
+			referenceLength = 0;
+			state = State::Reference;
+		}
+		break;
+	case State::EmptyTagEnd:
+		if (c == '>')
+		{
+			openElement();
+			closeElement();
+		}
+		else
+			state = State::Error;
+		break;
+	case State::EndTagName:
+		if (nameLength == 0 ? isNameStart(c) : isName(c))
+		{
+			nameHash = (nameHash ^ c) * hashPrime;
+			++nameLength;
+		}
+		else if (nameLength != 0 && isSpace(c))
+			state = State::AfterEndTagName;
+		else if (nameLength != 0 && c == '>')
+			closeElement();
+		else
+			state = State::Error;
+		break;
+	case State::AfterEndTagName:
+		if (c == '>')
+			closeElement();
+		else if (!isSpace(c))
+			state = State::Error;
+		break;
+	case State::Reference:
+		if (c == '#' && referenceLength == 0)
+		{
+			hexReference = false;
+			state = State::CharacterReference;
+		}
+		else if (c == ';' && referenceLength != 0)
+		{
+			if (reference != entityAmp && reference != entityLt
+				&& reference != entityGt && reference != entityQuot
+				&& reference != entityApos)
+				state = State::Error;
+			else
+				endReference();
+		}
+		else if (referenceLength < 4 && c >= 'a' && c <= 'z')
+		{
+			reference = reference << 8 | c;
+			++referenceLength;
+		}
+		else
+			state = State::Error;
+		break;
+	case State::CharacterReference:
+		if (c == 'x' && referenceLength == 0 && !hexReference)
+			hexReference = true;
+		else if (c == ';' && referenceLength != 0)
+		{
+			// Only characters allowed in XML can be referenced
+			if (reference == 0 || reference > 0x10FFFF
+				|| (reference < 0x20 && !isSpace(reference)))
+				state = State::Error;
+			else
+				endReference();
+		}
+		else if (c >= '0' && c <= '9' && referenceLength < 8)
+		{
+			reference = reference * (hexReference ? 16 : 10) + (c - '0');
+			++referenceLength;
+		}
+		else if (hexReference && referenceLength < 8
+			&& ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')))
+		{
+			reference = reference * 16 + ((c | 0x20) - 'a' + 10);
+			++referenceLength;
+		}
+		else
+			state = State::Error;
+		break;
+	case State::ProcessingInstruction:
+		// Ends at ?>
+		if (c == '>' && matched == 1)
+			state = State::Content;
+		else
+			matched = c == '?';
+		break;
+	case State::Markup:
+		// Comment, CDATA section, or document type declaration
+		if (!literal)
+		{
+			if (c == '-')
+				literal = "--";
+			else if (c == '[' && depth != 0)
+				literal = "[CDATA[";
+			else if (c == 'D' && !rootOpened)
+				literal = "DOCTYPE";
+			else
+			{
+				state = State::Error;
+				break;
+			}
+		}
+		if (literal[matched] != c)
+		{
+			state = State::Error;
+			break;
+		}
+		if (literal[++matched] == '\0')
+		{
+			if (literal[0] == '-')
+				state = State::Comment;
+			else if (literal[0] == '[')
+				state = State::CData;
+			else
+				state = State::Doctype;
+			matched = 0;
+		}
+		break;
+	case State::Comment:
+		// Ends at -->, and may not contain --
+		if (matched == 2)
+			state = c == '>' ? State::Content : State::Error;
+		else if (c == '-')
+			++matched;
+		else
+			matched = 0;
+		break;
+	case State::CData:
+		// Ends at ]]>
+		if (c == '>' && matched >= 2)
+			state = State::Content;
+		else if (c == ']')
+			++matched;
+		else
+			matched = 0;
+		break;
+	case State::Doctype:
+		// Internal subsets are not used by debug data
+		if (c == '[')
+			state = State::Error;
+		else if (c == '>')
+			state = State::Content;
+		break;
+	case State::Error:
+		break;
+	}
+}
+
+void XmlChecker::endReference()
+{
+	state = referenceReturn;
+}
+
+void XmlChecker::openElement()
+{
+	// A document has only one root element
+	if (rootClosed || depth == maxDepth)
+	{
+		state = State::Error;
+		return;
+	}
+
+	rootOpened = true;
+	nameHashes[depth] = nameHash;
+	nameLengths[depth] = nameLength;
+	++depth;
+}
+
+void XmlChecker::closeElement()
+{
+	if (state == State::Error)
+		return;
+	if (depth == 0 || nameHashes[depth - 1] != nameHash
+		|| nameLengths[depth - 1] != nameLength)
+	{
+		state = State::Error;
+		return;
+	}
+
+	--depth;
+	if (depth == 0)
+		rootClosed = true;
+	state = State::Content;
+}
+
+bool XmlChecker::isSpace(uint8_t c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+bool XmlChecker::isNameStart(uint8_t c)
+{
+	// Bytes of multibyte UTF-8 characters are all accepted
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'
+		|| c == ':' || c >= 0x80;
+}
+
+bool XmlChecker::isName(uint8_t c)
+{
+	return isNameStart(c) || (c >= '0' && c <= '9') || c == '-' || c == '.';
+}
@@ -0,0 +1,130 @@
+// Dumps a recovery journal as JSON for inspection and debugging.
+//
+// Usage: Journal_Export <journal> [output.json]
+
+#include "../Journal.h"
+
+#include <cstdio>
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+static QString hex(uint64_t value)
+{
+	return "0x" + QString::number(value, 16).toUpper();
+}
+
+int main(int argc, char* argv[])
+{
+	QCoreApplication app(argc, argv);
+	QStringList args = app.arguments();
+	if (args.size() < 2)
+	{
+		fprintf(stderr, "Usage: Journal_Export <journal> [output.json]\n");
+		return 1;
+	}
+
+	Journal journal;
+	if (!journal.openReadOnly(args[1]))
+	{
+		fprintf(stderr, "Failed to open journal %s\n", qPrintable(args[1]));
+		return 1;
+	}
+
+	QJsonArray scanned;
+	QJsonArray found;
+	QJsonArray validated;
+	QJsonArray defragged;
+	QJsonArray extracted;
+	QJsonObject defrag;
+	QJsonArray fragments;
+	int remainingFragments = 0;
+	journal.forEach([&](int64_t index, const Journal::Record& record)
+		{
+			QJsonObject entry;
+			switch (record.type)
+			{
+			case Journal::RecordType::Scanned:
+				entry["start"] = hex(record.offset);
+				entry["end"] = hex(record.data[0]);
+				entry["versionLimit"] = record.state;
+				scanned.append(entry);
+				break;
+			case Journal::RecordType::Found:
+				entry["offset"] = hex(record.offset);
+				entry["magic"] = QString::fromLatin1(
+					reinterpret_cast<const char*>(&record.value), 4);
+				entry["version"] = record.count;
+				entry["versionLimit"] = record.state;
+				found.append(entry);
+				break;
+			case Journal::RecordType::Validated:
+				entry["offset"] = hex(record.offset);
+				entry["hash"] = hex(record.value);
+				entry["corrupt"] = record.state;
+				entry["size"] = hex(record.data[0]);
+				entry["failPos"] = hex(record.data[1]);
+				validated.append(entry);
+				break;
+			case Journal::RecordType::Defragged:
+				defrag = {};
+				defrag["offset"] = hex(record.offset);
+				defrag["corrupt"] = record.state;
+				defrag["searchAll"] = record.value != 0;
+				defrag["searchLength"] = hex(record.data[0]);
+				fragments = {};
+				remainingFragments = record.count;
+				if (remainingFragments == 0)
+					defragged.append(defrag);
+				break;
+			case Journal::RecordType::Fragment:
+				entry["pos"] = hex(record.data[0]);
+				entry["size"] = hex(record.data[1]);
+				fragments.append(entry);
+				if (remainingFragments > 0 && --remainingFragments == 0)
+				{
+					defrag["fragments"] = fragments;
+					defragged.append(defrag);
+				}
+				break;
+			case Journal::RecordType::Extracted:
+				entry["offset"] = hex(record.offset);
+				entry["pathHash"] = hex(record.value);
+				extracted.append(entry);
+				break;
+			default:
+				fprintf(stderr, "Unknown record type %d at index %lld\n",
+					static_cast<int>(record.type), (long long)index);
+				break;
+			}
+		});
+
+	QJsonObject root;
+	root["records"] = (qint64)journal.size();
+	root["scanned"] = scanned;
+	root["found"] = found;
+	root["validated"] = validated;
+	root["defragged"] = defragged;
+	root["extracted"] = extracted;
+	QByteArray json = QJsonDocument(root).toJson();
+
+	if (args.size() < 3)
+	{
+		fwrite(json.constData(), 1, json.size(), stdout);
+		return 0;
+	}
+
+	QFile out(args[2]);
+	if (!out.open(QIODevice::WriteOnly))
+	{
+		fprintf(stderr, "Failed to open %s for writing\n", qPrintable(args[2]));
+		return 1;
+	}
+	out.write(json);
+	out.close();
+
+	return 0;
+}